@@ -0,0 +1,113 @@
+#!/bin/sh
+# Benchmark oddie against the SQLite ODBC driver, see "Benchmarking" in README.md.
+#
+#   ./bench.sh [output.csv]
+#
+# Builds oddie against unixODBC if it isn't there, generates the table in bench.db, runs the
+# query in single query mode and in daemon mode and appends a CSV line for each to the output
+# (bench.csv by default, with a header line when it's new): rows and bytes per second, and for
+# daemon mode the TIMING stages in microseconds, averaged over the requests.
+#
+# Settings, from the environment:
+#   ROWS=100000             rows in the generated table, it's generated again when they differ
+#   REQUESTS=20             requests in the daemon mode run
+#   QUERY="select * from t"
+#   FIELDS=                 more request fields for daemon mode, eg FIELDS="ZIP=6,HASH=XXH64"
+#   DRIVER=SQLite3          the driver's name in odbcinst.ini
+#   DB=bench.db
+#   DRVC="Driver=$DRIVER;Database=$DB"
+#   ODDIE=./oddie           built if it doesn't exist
+
+set -e
+
+ROWS=${ROWS:-100000}
+REQUESTS=${REQUESTS:-20}
+QUERY=${QUERY:-select * from t}
+DRIVER=${DRIVER:-SQLite3}
+DB=${DB:-bench.db}
+DRVC=${DRVC:-Driver=$DRIVER;Database=$DB}
+ODDIE=${ODDIE:-./oddie}
+OUT=${1:-bench.csv}
+FIELDS=${FIELDS:+,$FIELDS}
+TMP=${TMPDIR:-/tmp}/oddie-bench.$$
+
+trap 'rm -f "$TMP" "$TMP.timing"' EXIT
+
+if [ ! -x "$ODDIE" ]
+then
+    gcc -Wall -Wextra -pedantic -std=gnu99 -O2 oddie.c md5.c xxhash.c -o "$ODDIE" -lodbc -lz -lpthread
+fi
+
+# the table from README.md
+if [ "$(sqlite3 "$DB" "select count(*) from t" 2>/dev/null)" != "$ROWS" ]
+then
+    rm -f "$DB"
+    sqlite3 "$DB" "create table t (id integer, name varchar(40), amount real, note varchar(200), data blob);
+with recursive n(i) as (select 0 union all select i + 1 from n where i < $ROWS - 1)
+insert into t select i, 'name ' || i, i * 1.5,
+    case when i % 10 = 0 then null else printf('%.*c', 100, 'x') end,
+    case when i % 4 = 0 then randomblob(2048) end from n;"
+fi
+
+if [ ! -f "$OUT" ]
+then
+    echo "mode,query,fields,requests,rows,bytes,seconds,rows_per_sec,bytes_per_sec,parse,execute,fetch,hash,compress,emit,result_bytes,zbytes" > "$OUT"
+fi
+
+now()
+{
+    date +%s.%N
+}
+
+# mode, requests, rows, start, end, the TIMING fields averaged or empty
+report()
+{
+    bytes=$(wc -c < "$TMP")
+
+    awk -v mode="$1" -v query="$QUERY" -v fields="${FIELDS#,}" -v requests="$2" -v rows="$3" -v bytes="$bytes" \
+        -v start="$4" -v end="$5" -v timing="$6" 'BEGIN {
+        s = end - start
+        fields = (mode == "single" ? "" : fields)
+        gsub(/"/, "\"\"", query)
+        gsub(/"/, "\"\"", fields)
+        printf "%s,\"%s\",\"%s\",%d,%d,%d,%.3f,%.0f,%.0f,%s\n", mode, query, fields, requests, rows, bytes, s,
+            (s > 0 ? rows / s : 0), (s > 0 ? bytes / s : 0), timing
+    }' | tee -a "$OUT"
+}
+
+# single query mode: connect, run, exit; the rows are the lines after the header
+start=$(now)
+"$ODDIE" "$DRVC" "$QUERY" > "$TMP"
+end=$(now)
+rows=$(grep -o '%0A' "$TMP" | wc -l)
+report single 1 $((rows - 1)) "$start" "$end" ",,,,,,,"
+
+# daemon mode: one connection, REQUESTS requests with TIMING=1
+start=$(now)
+i=0
+while [ $i -lt "$REQUESTS" ]
+do
+    printf 'SQL="%s",TIMING=1%s;' "$QUERY" "$FIELDS"
+    i=$((i + 1))
+done | { cat; printf 'CLOSE=0;'; } | "$ODDIE" "$DRVC" > "$TMP"
+end=$(now)
+
+grep -o 'TIMING="[^"]*"' "$TMP" | tr -d '"' | sed 's/^TIMING=//' | awk -F, '
+    {
+        for (i = 1; i <= NF; i++)
+        {
+            split($i, kv, "=")
+            sum[kv[1]] += kv[2]
+        }
+        n++
+    }
+    END {
+        if (!n)
+            exit 1
+        printf "%d %.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n", sum["rows"], sum["parse"] / n, sum["execute"] / n,
+            sum["fetch"] / n, sum["hash"] / n, sum["compress"] / n, sum["emit"] / n, sum["bytes"] / n, sum["zbytes"] / n
+    }' > "$TMP.timing" || { echo "no TIMING in the responses:" >&2; head -c 500 "$TMP" >&2; rm -f "$TMP.timing"; exit 1; }
+
+read rows timing < "$TMP.timing"
+rm -f "$TMP.timing"
+report daemon "$REQUESTS" "$rows" "$start" "$end" "$timing"
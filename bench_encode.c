@@ -0,0 +1,240 @@
+/*
+ * Throughput of the result encoding: the encode_mem() kernels and encode_buf() against the
+ * encode_out() and url_encode() they replaced, on text, on random binary and on data that is
+ * all escapes. Every kernel's output is checked against encode_out()'s first.
+ *
+ *   gcc -Wall -Wextra -std=gnu99 -O2 bench_encode.c md5.c xxhash.c -o bench_encode -lodbc -lz -lpthread
+ *   ./bench_encode [MB]
+ *
+ * oddie.c is built in with its main() renamed, so this measures the code as it is.
+ */
+#define main oddie_main
+#include "oddie.c"
+#undef main
+
+#define BENCH_MB 16                     // default input size
+#define BENCH_SECONDS 1                 // minimum run time per measurement
+
+long old_encode_out(FILE *stream, unsigned char *b, long len);
+char *old_url_encode(const char *src, int len, int force, char *buffer);
+long encode_out_mem(unsigned char *b, long len);
+void bench(const char *data_name, const char *name, unsigned char *src, long len, int kind);
+long run_kernel(long (*kernel)(unsigned char *, const unsigned char *, long), unsigned char *src, long len, unsigned char *dest);
+
+// what's measured: a kernel into memory, encode_buf() into a result buffer (as text and as a binary column), url_encode() old and new, encode_out()
+enum {KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2, ENCODE_BUF, ENCODE_BUF_BINARY, URL_ENCODE, OLD_URL_ENCODE, OLD_ENCODE_OUT};
+
+unsigned char *expected, *scratch;
+long expected_len;
+FILE *null_out;
+
+int main(int argc, char *argv[])
+{
+    const char *data_names[] = {"text", "binary", "escapes"};
+    long len = (argc > 1 ? atol(argv[1]) : BENCH_MB) * 1024 * 1024, i;
+    unsigned char *src = (unsigned char *) malloc(len);
+    unsigned int seed = 1;
+    int data;
+
+    encode_init();
+    scratch = (unsigned char *) malloc(3 * len + 32);
+    expected = (unsigned char *) malloc(3 * len + 32);
+
+    if (!(null_out = fopen("/dev/null", "wb")))
+        null_out = tmpfile();
+
+    printf("%-8s %-16s %10s %8s\n", "data", "encoder", "MB/s", "out/in");
+
+    for (data = 0; data < 3; data++)
+    {
+        // text with a tab every 12 bytes and a newline every 80, random bytes, or nothing but delimiters
+        for (i = 0; i < len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            if (data == 0)
+                src[i] = (i % 80 == 79 ? '\n' : i % 12 == 11 ? '\t' : 'a' + (seed >> 16) % 26);
+            else if (data == 1)
+                src[i] = (unsigned char) (seed >> 16);
+            else
+                src[i] = ";,=%\""[(seed >> 16) % 5];
+        }
+
+        // the reference output
+        expected_len = encode_out_mem(src, len);
+        memcpy(expected, scratch, expected_len);
+
+        bench(data_names[data], "encode_out (old)", src, len, OLD_ENCODE_OUT);
+        bench(data_names[data], "url_encode (old)", src, len, OLD_URL_ENCODE);
+        bench(data_names[data], "url_encode", src, len, URL_ENCODE);
+        bench(data_names[data], "encode_scalar", src, len, KERNEL_SCALAR);
+#if defined(ENCODE_SIMD)
+        if (__builtin_cpu_supports("sse2"))
+            bench(data_names[data], "encode_sse2", src, len, KERNEL_SSE2);
+
+        if (__builtin_cpu_supports("avx2"))
+            bench(data_names[data], "encode_avx2", src, len, KERNEL_AVX2);
+#endif
+        bench(data_names[data], "encode_buf", src, len, ENCODE_BUF);
+        bench(data_names[data], "encode_buf binary", src, len, ENCODE_BUF_BINARY);
+    }
+
+    fclose(null_out);
+    free(src);
+    free(scratch);
+    free(expected);
+
+    return 0;
+}
+
+// run one encoder over src until BENCH_SECONDS have passed and print its throughput
+void bench(const char *data_name, const char *name, unsigned char *src, long len, int kind)
+{
+    s_buffer b;
+    long long start = clock_usec(), spent;
+    long out_len = 0, runs = 0;
+
+    buf_init(&b);
+    b.spill = 0;
+
+    do
+    {
+        switch (kind)
+        {
+            case KERNEL_SCALAR:
+                out_len = run_kernel(encode_scalar, src, len, scratch);
+                break;
+#if defined(ENCODE_SIMD)
+            case KERNEL_SSE2:
+                out_len = run_kernel(encode_sse2, src, len, scratch);
+                break;
+            case KERNEL_AVX2:
+                out_len = run_kernel(encode_avx2, src, len, scratch);
+                break;
+#endif
+            case ENCODE_BUF:
+                buf_clear(&b);
+                out_len = encode_buf(&b, src, len, 0);
+                break;
+            case ENCODE_BUF_BINARY:
+                buf_clear(&b);
+                out_len = encode_buf(&b, src, len, 1);
+                break;
+            case URL_ENCODE:
+                url_encode((char *) src, (int) len, 0, (char *) scratch);
+                break;
+            case OLD_URL_ENCODE:
+                old_url_encode((char *) src, (int) len, 0, (char *) scratch);
+                break;
+            case OLD_ENCODE_OUT:
+                old_encode_out(null_out, src, len);
+                break;
+        }
+
+        runs++;
+    }
+    while ((spent = clock_usec() - start) < BENCH_SECONDS * 1000000LL);
+
+    // url_encode() leaves most control characters alone, its output is its own; encode_out()'s went to the stream
+    if (kind == URL_ENCODE || kind == OLD_URL_ENCODE)
+        out_len = strlen((char *) scratch);
+    else if (kind == OLD_ENCODE_OUT)
+        out_len = expected_len;
+    else if (kind == ENCODE_BUF || kind == ENCODE_BUF_BINARY)
+    {
+        buf_rewind(&b);
+        buf_read(&b, scratch, out_len);
+    }
+
+    if (kind <= ENCODE_BUF_BINARY && (out_len != expected_len || memcmp(scratch, expected, out_len) != 0))
+        printf("%-8s %-16s output differs from encode_out()\n", data_name, name);
+    else
+        printf("%-8s %-16s %10.1f %8.2f\n", data_name, name, (double) len * runs / spent, (double) out_len / len);
+
+    buf_free(&b);
+}
+
+// a kernel over src in ENCODE_BLOCK pieces, the way encode_buf() calls it
+long run_kernel(long (*kernel)(unsigned char *, const unsigned char *, long), unsigned char *src, long len, unsigned char *dest)
+{
+    long i, n = 0;
+
+    for (i = 0; i < len; i += ENCODE_BLOCK)
+        n += kernel(dest + n, src + i, (len - i < ENCODE_BLOCK ? len - i : ENCODE_BLOCK));
+
+    return n;
+}
+
+// encode_out() into scratch rather than a stream, for the reference output
+long encode_out_mem(unsigned char *b, long len)
+{
+    long i, n = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (b[i] < 32 || b[i] == '"' || b[i] == '%' || b[i] == ';' || b[i] == ',' || b[i] == '=')
+            n += sprintf((char *) scratch + n, "%%%02X", b[i]);
+        else
+            scratch[n++] = b[i];
+    }
+
+    return n;
+}
+
+// encode_out() and url_encode() as they were before the encode kernels
+long old_encode_out(FILE *stream, unsigned char *b, long len)
+{
+    char encode[4];
+    long i, n = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (b[i] < 32 || b[i] == '"' || b[i] == '%' || b[i] == ';' || b[i] == ',' || b[i] == '=')
+        {
+            sprintf(encode, "%%%02X", b[i]);
+            n+= fputs(encode, stream);
+        }
+        else
+        {
+            fputc(b[i], stream);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+char *old_url_encode(const char *src, int len, int force, char *buffer)
+{
+    char *dest, encode[16], tmp;
+    int j, k;
+
+    if (src == NULL)
+        return NULL;
+
+    dest = (buffer ? buffer : (char *) malloc(sizeof(char) * len * 3 + 1));
+
+    for (j = k = 0; j < len; j++)
+    {
+        tmp = src[j];
+
+        if (force ||
+            tmp == '\0' || tmp == '\t' || tmp == '\n' ||
+            tmp == '\r' || tmp == '"' || tmp == '%' ||
+            tmp == ';' || tmp == ',' || tmp == '=')
+        {
+            // force is for md5 encoding, convert to hex string without '%'
+            if (!force)
+                dest[k++] = '%';
+
+            sprintf(encode, "%02X", (unsigned char) tmp);
+            dest[k++] = encode[0];
+            dest[k++] = encode[1];
+        }
+        else
+            dest[k++] = tmp;
+    }
+
+    dest[k] = 0;
+    return dest;
+}
@@ -0,0 +1,135 @@
+/*
+ * Hashing throughput of MD5 (md5.c) and XXH64 (xxhash.c), the two HASH= choices, fed in
+ * pieces of the sizes oddie hands them: single values up to whole result chunks.
+ * Both are checked against known digests first.
+ *
+ *   gcc -Wall -Wextra -std=gnu99 -O2 bench_hash.c md5.c xxhash.c -o bench_hash
+ *   ./bench_hash [MB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "md5.h"
+#include "xxhash.h"
+
+#define BENCH_MB 64                     // default input size
+#define BENCH_SECONDS 1                 // minimum run time per measurement
+
+int check(void);
+void hex(const unsigned char *digest, int len, char *out);
+double bench_md5(unsigned char *data, unsigned long len, unsigned piece);
+double bench_xxh64(unsigned char *data, unsigned long len, unsigned piece);
+
+int main(int argc, char *argv[])
+{
+    const unsigned pieces[] = {8, 32, 256, 4096, 65536};
+    unsigned long len = (argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_MB) * 1024 * 1024, i;
+    unsigned char *data = (unsigned char *) malloc(len);
+    double md5, xxh64;
+    unsigned p;
+
+    if (!check())
+        return 1;
+
+    for (i = 0; i < len; i++)
+        data[i] = (unsigned char) (i * 2654435761u >> 13);
+
+    printf("%8s %12s %12s %8s\n", "piece", "MD5 MB/s", "XXH64 MB/s", "ratio");
+
+    for (p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++)
+    {
+        md5 = bench_md5(data, len, pieces[p]);
+        xxh64 = bench_xxh64(data, len, pieces[p]);
+        printf("%8u %12.1f %12.1f %8.1f\n", pieces[p], md5, xxh64, xxh64 / md5);
+    }
+
+    free(data);
+
+    return 0;
+}
+
+// the reference digests of "" and "abc"
+int check(void)
+{
+    MD5Context md5;
+    XXH64Context xxh;
+    unsigned char digest[16];
+    char out[33];
+    int ok = 1;
+
+    MD5Init(&md5);
+    MD5Update(&md5, (unsigned char *) "abc", 3);
+    MD5Final(digest, &md5);
+    hex(digest, 16, out);
+    ok &= (strcmp(out, "900150983CD24FB0D6963F7D28E17F72") == 0);
+
+    XXH64Init(&xxh, 0);
+    XXH64Final(digest, &xxh);
+    hex(digest, 8, out);
+    ok &= (strcmp(out, "EF46DB3751D8E999") == 0);
+
+    XXH64Init(&xxh, 0);
+    XXH64Update(&xxh, (const unsigned char *) "abc", 3);
+    XXH64Final(digest, &xxh);
+    hex(digest, 8, out);
+    ok &= (strcmp(out, "44BC2CF5AD770999") == 0);
+
+    if (!ok)
+        fprintf(stderr, "wrong digest\n");
+
+    return ok;
+}
+
+void hex(const unsigned char *digest, int len, char *out)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        sprintf(out + 2 * i, "%02X", digest[i]);
+}
+
+// MB/s hashing data piece bytes at a time, over and over until BENCH_SECONDS have passed
+double bench_md5(unsigned char *data, unsigned long len, unsigned piece)
+{
+    MD5Context ctx;
+    unsigned char digest[16];
+    unsigned long i, runs = 0;
+    clock_t start = clock(), spent;
+
+    do
+    {
+        MD5Init(&ctx);
+
+        for (i = 0; i < len; i += piece)
+            MD5Update(&ctx, data + i, (len - i < piece ? len - i : piece));
+
+        MD5Final(digest, &ctx);
+        runs++;
+    }
+    while ((spent = clock() - start) < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    return (double) len * runs / 1e6 / ((double) spent / CLOCKS_PER_SEC);
+}
+
+double bench_xxh64(unsigned char *data, unsigned long len, unsigned piece)
+{
+    XXH64Context ctx;
+    unsigned char digest[8];
+    unsigned long i, runs = 0;
+    clock_t start = clock(), spent;
+
+    do
+    {
+        XXH64Init(&ctx, 0);
+
+        for (i = 0; i < len; i += piece)
+            XXH64Update(&ctx, data + i, (len - i < piece ? len - i : piece));
+
+        XXH64Final(digest, &ctx);
+        runs++;
+    }
+    while ((spent = clock() - start) < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    return (double) len * runs / 1e6 / ((double) spent / CLOCKS_PER_SEC);
+}
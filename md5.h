@@ -1,8 +1,8 @@
 #ifndef MD5_H
 #define MD5_H
 
-// xxx add ifdef for 64 bits
-typedef unsigned long uint32;
+// unsigned long is 64 bits on LP64 systems, int is 32 bits everywhere we build
+typedef unsigned int uint32;
 
 typedef struct
 {
@@ -11,9 +11,9 @@ typedef struct
     unsigned char in[64];
 } MD5Context;
 
-extern void MD5Init();
-extern void MD5Update();
-extern void MD5Final();
-extern void MD5Transform();
+extern void MD5Init(MD5Context *ctx);
+extern void MD5Update(MD5Context *ctx, unsigned char *buf, unsigned len);
+extern void MD5Final(unsigned char digest[16], MD5Context *ctx);
+extern void MD5Transform(uint32 buf[4], uint32 in[16]);
 
 #endif
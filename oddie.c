@@ -3,16 +3,29 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <time.h>
 #if defined(WIN32)
+#  ifndef _WIN32_WINNT
+#    define _WIN32_WINNT 0x0600 /* condition variables */
+#  endif
+#  include <winsock2.h> /* before windows.h, which brings in the old winsock.h otherwise */
 #  include <windows.h>
 #endif
 #include <sql.h>
 #include <sqlext.h>
 #include "md5.h"
+#include "xxhash.h"
 #include "zlib.h"
+#if defined(HAVE_ZSTD)
+#  include "zstd.h"
+#endif
+#if defined(HAVE_LZ4)
+#  include "lz4frame.h"
+#endif
 
 #if defined(WIN32) || defined(__CYGWIN__)
 #  include <fcntl.h>
@@ -21,6 +34,72 @@
 #else
 #  define SET_BINARY_MODE(file)
 #endif
+#if defined(WIN32)
+#  define READ_INPUT(buf, len) _read(_fileno(stdin), buf, len)
+#  define strncasecmp _strnicmp
+#  define strcasecmp _stricmp
+#else
+#  include <unistd.h>
+#  define READ_INPUT(buf, len) read(fileno(stdin), buf, len)
+#endif
+#if defined(WIN32)
+   typedef HANDLE thread_t;
+   typedef CRITICAL_SECTION mutex_t;
+   typedef CONDITION_VARIABLE cond_t;
+#  define THREAD_PROC(name, arg) DWORD WINAPI name(LPVOID arg)
+#  define thread_create(t, proc, arg) ((*(t) = CreateThread(NULL, 0, proc, arg, 0, NULL)) != NULL)
+#  define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#  define mutex_init(m) InitializeCriticalSection(m)
+#  define mutex_lock(m) EnterCriticalSection(m)
+#  define mutex_unlock(m) LeaveCriticalSection(m)
+#  define mutex_destroy(m) DeleteCriticalSection(m)
+#  define cond_init(c) InitializeConditionVariable(c)
+#  define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#  define cond_signal(c) WakeConditionVariable(c)
+#  define cond_broadcast(c) WakeAllConditionVariable(c)
+#  define cond_destroy(c)
+#else
+#  include <pthread.h>
+   typedef pthread_t thread_t;
+   typedef pthread_mutex_t mutex_t;
+   typedef pthread_cond_t cond_t;
+#  define THREAD_PROC(name, arg) void *name(void *arg)
+#  define thread_create(t, proc, arg) (pthread_create(t, NULL, proc, arg) == 0)
+#  define thread_join(t) pthread_join(t, NULL)
+#  define mutex_init(m) pthread_mutex_init(m, NULL)
+#  define mutex_lock(m) pthread_mutex_lock(m)
+#  define mutex_unlock(m) pthread_mutex_unlock(m)
+#  define mutex_destroy(m) pthread_mutex_destroy(m)
+#  define cond_init(c) pthread_cond_init(c, NULL)
+#  define cond_wait(c, m) pthread_cond_wait(c, m)
+#  define cond_signal(c) pthread_cond_signal(c)
+#  define cond_broadcast(c) pthread_cond_broadcast(c)
+#  define cond_destroy(c) pthread_cond_destroy(c)
+#endif
+#if defined(WIN32)
+#  define poll WSAPoll
+#  define socket_close closesocket
+#  define SHUT_RDWR SD_BOTH
+#  define socket_blocked() (WSAGetLastError() == WSAEWOULDBLOCK)
+   typedef int socklen_t;
+#else
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <errno.h>
+#  include <fcntl.h>
+#  define socket_close close
+#  define INVALID_SOCKET (-1)
+#  define socket_blocked() (errno == EAGAIN || errno == EWOULDBLOCK)
+   typedef int SOCKET;
+#endif
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#  include <immintrin.h>
+#  define ENCODE_SIMD /* SSE2/AVX2 encode kernels, picked at run time */
+#endif
 #if defined(__MWERKS__) && __dest_os != __be_os && __dest_os != __win32_os
 #  include <unix.h> /* for fileno */
 #endif
@@ -28,8 +107,48 @@
   extern int unlink OF((const char *));
 #endif
 
-#define QUERY_BUFFER_SIZE 8192
+#define INPUT_BLOCK (64 * 1024)         // initial size and read size of the request buffer
 #define Z_CHUNK (256 * 1024)
+#define FETCH_ROWS 256                  // default rows per block fetch, override with ROWS=
+#define FETCH_BLOCK_SIZE (1024 * 1024)  // upper bound for the bound row array of a block fetch
+#define FETCH_BIND_MAX 8000             // wider columns are treated as long and use SQLGetData
+#define BUF_CHUNK (64 * 1024)
+#define BUF_SPARE 64                    // chunks buf_clear() keeps for a buffer's next writes, see s_buffer
+#define SPILL_SIZE (64 * 1024 * 1024)   // default for --spill
+#define ZIP_PROBE 512                   // result length after which zip_policy() can't change its mind
+#define ZIP_SAMPLE (64 * 1024)          // result bytes CODEC=auto tries the codecs on, see zip_adapt()
+#define ZIP_TARGET 100                  // default for --zip-target, MB/s
+#define LZ4_SLICE (64 * 1024)           // input bytes per LZ4F_compressUpdate(), its output fits in Z_CHUNK
+#define ZIP_BLOCK (1024 * 1024)         // default for --zip-block, input bytes per block with --zip-threads
+#define ZIP_WINDOW (32 * 1024)          // deflate history a block is primed with from the block before
+#define ENCODE_BLOCK 4096               // input bytes encoded per pass by encode_buf()
+#define ENCODE_DENSE 2                  // escapes per 16 bytes above which the SIMD encoders go byte at a time
+#define ENCODE_DENSE_RUN 256            // bytes encoded byte at a time once they do, see encode_sse2()
+#define MAX_WORKERS 64
+#define READ_AHEAD 64                   // default for --read-ahead, requests queued ahead of the ones running
+#define LISTEN_POLL 100                 // ms between looks for clients that are gone, with --listen
+#define CLIENT_AHEAD 64                 // requests of a --listen client parsed ahead of the one it's waiting for
+#define CLIENT_QUEUED (4 * 1024 * 1024) // STREAM=1 bytes queued for a --listen client before the worker waits for it
+#define GROUP_WINDOW 5                  // default for --group-window, ms a group commit waits for more writes
+#define STMT_CACHE_SIZE 256            // prepared statements kept per connection, see stmt_prepare()
+#define PARAM_LONG 8000                 // string/binary parameters longer than this are bound as long data
+#define BULK_BATCH 1000                 // default for BATCH=, BULK rows per execute
+#define BULK_BATCH_MAX 65536            // most BULK rows per execute, larger BATCH= values are cut to it
+#define RESULT_TTL 60                   // seconds a cached result stays fresh, see result_get()
+#define DELTA_CACHE (16 * 1024 * 1024)  // default for --delta-cache, bytes of row hashes kept for DELTA=1
+#define DELTA_EDITS 1000                // most changed rows a DELTA is worked out for
+#define STREAM_CHUNK (64 * 1024)       // result bytes per CHUNK frame with STREAM=1
+#define COLUMNAR_BATCH 65536            // rows per batch with FORMAT=columnar
+#define CURSOR_LIMIT 16                 // default for --cursors
+#define CURSOR_TTL 300                  // default for --cursor-ttl, seconds an idle cursor is kept
+#define STAT_TYPES 5                    // select, insert, update, delete, anything else
+#define STAT_BUCKETS 32                 // latency histogram buckets, powers of 2 microseconds
+#define STAT_SOURCES 32                 // distinct error sources counted
+#define STANDBY_CHECK 30                // seconds between looks at whether the --standby connection is still alive
+
+// stage timers for TIMING=1, the clock is only read when the request asked for it
+#define timer_start(request) ((request)->timing ? clock_usec() : 0)
+#define timer_stop(request, start) ((request)->timing ? clock_usec() - (start) : 0)
 
 #define IS_SQL_SUCCESS(x) ((x) == SQL_SUCCESS || (x) == SQL_SUCCESS_WITH_INFO)
 #define hex_digit_to_int(c) \
@@ -50,83 +169,779 @@ typedef struct
 {
     SQLCHAR       col_name[64];
     SQLSMALLINT   col_name_len;
-    SQLSMALLINT   data_type;
-    SQLUINTEGER   col_size;
+    SQLSMALLINT   data_type;    // the C type it's fetched as, once sql_fetch() has picked it
+    SQLULEN       col_size;
     SQLSMALLINT   decimal_digits;
     SQLSMALLINT   nullable;
     SQLINTEGER    io_len;
+    SQLLEN        width;    // bytes per row in data when bound for a block fetch
+    unsigned char *data;
+    SQLLEN        *ind;
 } s_col_data;
 
+// what one request spent where, in microseconds, returned with TIMING=1
 typedef struct
 {
+    long long     parse, execute, fetch, hash, compress, emit;
+    unsigned long rows, bytes, zbytes;
+} s_timing;
+
+typedef struct s_request
+{
+    struct s_request *next; // worker queue
+    struct s_client *client;    // the --listen client it came from, NULL for stdin
+    unsigned long seq;      // place in the queue, for --ordered
     char    id[64];
     char    md5[33];
-    char    sql[QUERY_BUFFER_SIZE];
+    char    *sql;           // grows with the longest statement seen
+    unsigned long sql_size;
+    char    *params;        // PARAMS as sent, still encoded (see params_parse())
+    unsigned long params_size;
+    char    *bulk_rows;     // BULK as sent, types line first (see bulk_run())
+    unsigned long bulk_size;
+    int     bulk;           // BULK= was sent
+    unsigned long batch;    // BATCH=n, BULK rows per execute
     int     zip;
+    int     codec;          // CODEC_DEFLATE, CODEC_ZSTD or CODEC_LZ4, CODEC_AUTO until zip_adapt() picks one
+    int     codec_echo;     // CODEC= was sent, the response says which codec it got
+    int     rows;
+    int     ttl;            // -1 when not given
+    int     hash;           // HASH_MD5 or HASH_XXH64
+    int     timing;
+    s_timing times;
+    int     stats;          // STATS=1, report the counters instead of running anything
+    int     stream;         // STREAM=1, send SELECT results in CHUNK frames while fetching
+    struct s_buffer *stream_out;    // where those frames go, while fetching
+    unsigned long fetch;    // FETCH=n, rows per page of a cursor
+    unsigned long cursor;   // CURSOR=id, continue an open cursor instead of running sql
+    int     more;           // sql_fetch() stopped after fetch rows, not at the end of the result
+    int     format;         // FORMAT_TEXT or FORMAT_COLUMNAR
+    int     delta;          // DELTA=1, keep the row hashes of the result and answer MD5 with a DELTA when it can
+    struct s_columnar *columnar;    // the FORMAT=columnar batch being built, while fetching
+    int     timeout;        // TIMEOUT=seconds, -1 when not given
+    long long deadline;     // clock_usec() it times out at while running, 0 for never
+    volatile int stopped;   // STOP_CANCEL or STOP_TIMEOUT once it has been, see request_stopped()
+    char    cancel[64];     // CANCEL=id, stop that request instead of running anything
+    int     retry;          // a SELECT that can run once more if its connection is lost, see conn_retry()
+    int     getdata;        // its connection can SQLGetData a cell cut short in a block fetch, see sql_fetch_block()
+    unsigned long generation;   // of the result cache before its SELECT ran, see result_put()
 } s_request;
 
+#define STOP_CANCEL 1
+#define STOP_TIMEOUT 2
+
+#define HASH_MD5 0
+#define HASH_XXH64 1
+
+#define FORMAT_TEXT 0
+#define FORMAT_COLUMNAR 1
+
+#define CODEC_DEFLATE 0
+#define CODEC_ZSTD 1
+#define CODEC_LZ4 2
+#define CODEC_AUTO 3
+
+// running hash of a result, MD5 or the much faster XXH64 (see digest_init())
+typedef struct
+{
+    int             type;
+    MD5Context      md5;
+    XXH64Context    xxh;
+    long long       *spent; // time spent hashing is added here, when set
+} s_digest;
+
+// one statement parameter, bound with SQLBindParameter()
+typedef struct
+{
+    SQLSMALLINT   c_type, sql_type;
+    SQLULEN       size;
+    SQLPOINTER    data;
+    SQLLEN        len;      // SQL_NULL_DATA for NULL
+    SQLBIGINT     i;
+    double        f;
+} s_param;
+
+// one column of BULK rows, bound as an array of the values of a batch
+typedef struct
+{
+    char          type;     // i, f, s or b, as in PARAMS
+    SQLSMALLINT   c_type, sql_type;
+    SQLLEN        width;    // bytes per row in data, the longest value of the batch for s and b
+    unsigned char *data;
+    SQLLEN        *ind;
+} s_bulk_col;
+
+// daemon mode input, filled in blocks by get_request() and parsed in place
+typedef struct
+{
+    char            *buf;
+    unsigned long   pos, len, size;
+    unsigned long   scan;       // how far a request terminator has been searched for
+    int             quoted;     // scan stopped inside a quoted value
+} s_reader;
+
+typedef struct s_chunk
+{
+    struct s_chunk  *next;
+    unsigned long   len;
+    unsigned char   data[BUF_CHUNK];
+} s_chunk;
+
+// growable result buffer, kept in memory until it passes spill bytes, then moved to a temp file
+// with z set, everything written is compressed on the way in with codec (see oddie_deflate()),
+// in blocks on the zip pool when parallel is set
+// with direct set, file is an open stream everything is written straight to (see buf_init_file())
+typedef struct s_buffer
+{
+    s_chunk         *head, *tail, *rchunk;
+    s_chunk         *spare;     // chunks buf_clear() kept, written again before any new one is allocated
+    unsigned long   length, rpos, spill;
+    unsigned long   written;    // bytes written before compression
+    FILE            *file;
+    int             direct;
+    void            *z;         // z_stream, ZSTD_CCtx, LZ4F_cctx or with parallel s_pzip
+    int             codec;
+    int             parallel;
+    unsigned char   *zout;
+    long long       *ztime;     // time spent compressing is added here, when set
+} s_buffer;
+
+// growable byte array, for the buffers of a FORMAT=columnar batch
+typedef struct
+{
+    unsigned char   *data;
+    unsigned long   len, size;
+} s_bytes;
+
+// one column of a FORMAT=columnar batch, its buffers laid out like an Arrow array's
+typedef struct
+{
+    const char      *format;    // Arrow C data interface format string
+    SQLSMALLINT     c_type;
+    unsigned long   rows, nulls;
+    s_bytes         validity;   // a bit per row, set when the value isn't NULL
+    s_bytes         values;     // 8 bytes per row, or for "u" and "z" 32 bit offsets into data
+    s_bytes         data;
+} s_column;
+
+// FORMAT=columnar: the rows fetched so far that haven't gone out in a batch yet
+typedef struct s_columnar
+{
+    s_column        *cols;      // 1 based, like s_col_data
+    SQLSMALLINT     col_count;
+    unsigned long   rows;
+    s_buffer        *stream;
+    s_digest        *digest;
+    unsigned long   *total_len;
+} s_columnar;
+
+// a prepared statement handle, keyed by the statement text
+typedef struct
+{
+    char            *sql;
+    unsigned long   hash;
+    SQLHSTMT        sth;
+    unsigned long   used;   // tick of the last use, the lowest is evicted first
+} s_stmt;
+
+typedef struct
+{
+    s_stmt          *stmts;
+    int             size, count;
+    unsigned long   tick, hits, misses;
+} s_stmt_cache;
+
+// a response or STREAM=1 frame a --listen client's socket hasn't taken yet, see client_flush()
+typedef struct s_output
+{
+    struct s_output *next;
+    s_buffer        buf;
+    int             last;       // the end of a response, the client's next request can run once it's out
+    int             close;      // the request failed, the client is closed once it's out
+} s_output;
+
+// a --listen client, and the input it has sent that hasn't been run yet
+typedef struct s_client
+{
+    struct s_client *next;
+    SOCKET          sock;
+    s_reader        in;
+    int             busy;       // one of its requests is queued or running, the next one waits for it
+    s_request       *waiting;   // the ones after it, parsed ahead so a CANCEL= behind them isn't held up
+    int             waiting_count;
+    int             ending;     // a bad or empty request came in, closed once the ones before it are answered
+    int             closed;     // hung up or ended, freed by server_main() once it isn't busy
+    int             broken;     // a send failed, its output goes nowhere
+    s_output        *out, *out_tail;    // waiting for the socket, sent by whoever finds it writable
+    unsigned long   queued;     // bytes of them
+    unsigned char   send_buf[16 * 1024];
+    unsigned long   send_pos, send_len; // of the head output read into send_buf and not sent yet
+} s_client;
+
+// --listen: the socket clients connect to, and the clients, whose state is under lock
+typedef struct
+{
+    SOCKET          sock;
+    SOCKET          wake;       // a datagram to itself wakes server_main() from poll(), see server_wake()
+    mutex_t         lock;
+    cond_t          sent;       // a client's queued output went out or was dropped
+    s_client        *clients;
+    int             count;
+} s_server;
+
+// writes run in one transaction with --group-commit, their responses held until it's committed
+typedef struct
+{
+    s_request       **requests;
+    s_buffer        *responses;
+    int             count;
+    long long       started;    // clock_usec() of the first write
+} s_group;
+
+// a database connection and the statements prepared on it
+typedef struct
+{
+    SQLHDBC         dbh;
+    s_stmt_cache    cache;
+    s_group         group;
+    s_request       *request;   // the request running on it and its statement, for CANCEL=, see conn_run()
+    SQLHSTMT        active;
+    int             lost;       // it went away and couldn't be made again yet, see conn_reconnect()
+    int             getdata;    // 0 until asked, then 1 + whether SQLGetData works on a block of bound rows, see conn_getdata()
+} s_conn;
+
+typedef struct
+{
+    s_conn          *conn;
+    thread_t        thread;
+} s_worker;
+
+// a SELECT result kept by the result cache, encoded as sql_fetch() wrote it and uncompressed
+typedef struct s_result
+{
+    struct s_result *prev, *next;
+    char            *key;
+    unsigned long   hash;
+    time_t          stored;
+    char            md5[33];
+    unsigned long   length;     // data length as sql_fetch() reports it
+    unsigned long   rows;
+    unsigned long   size;       // bytes in data
+    unsigned char   *data;
+} s_result;
+
+// results shared by all connections, most recently used first
+typedef struct
+{
+    mutex_t         lock;
+    s_result        *head, *tail;
+    unsigned long   size, limit;
+    unsigned long   hits, misses;
+    unsigned long   generation; // bumped by result_invalidate(), see result_put()
+    int             ttl;
+} s_result_cache;
+
+// a SELECT left open by FETCH=n, continued by CURSOR=id requests
+typedef struct s_cursor
+{
+    struct s_cursor *next;
+    unsigned long   id;
+    SQLHSTMT        sth;
+    time_t          used;
+    int             busy;   // a request is fetching from it right now
+    SQLHDBC         dbh;    // the connection it's open on, see cursor_drop()
+} s_cursor;
+
+// open cursors of all connections, idle ones expire after ttl seconds
+typedef struct
+{
+    mutex_t         lock;
+    cond_t          idle;   // a cursor stopped being busy
+    s_cursor        *head;
+    int             count;  // open and reserved, never more than limit
+    int             limit, ttl;
+    unsigned long   last_id;
+} s_cursors;
+
+// row hashes of a DELTA=1 result, kept by the MD5 (or HASH) it went out with
+typedef struct s_snapshot
+{
+    struct s_snapshot *prev, *next;
+    char            md5[33];
+    unsigned long   rows;       // header included
+    uint64          *hashes;    // XXH64 of each row
+} s_snapshot;
+
+// snapshots shared by all connections, most recently used first
+typedef struct
+{
+    mutex_t         lock;
+    s_snapshot      *head, *tail;
+    unsigned long   size, limit;
+} s_snapshots;
+
+// one line of a DELTA, see delta_diff()
+typedef struct
+{
+    char            op;         // '-' or '+'
+    long            old_row, new_row;
+} s_edit;
+
+// reads an uncompressed text result a row at a time, see row_read()
+typedef struct
+{
+    s_buffer        *b;
+    unsigned char   buf[BUF_CHUNK];
+    unsigned long   pos, len;
+} s_row_reader;
+
+// daemon counters returned by STATS=1
+typedef struct
+{
+    mutex_t         lock;
+    unsigned long   requests[STAT_TYPES];
+    unsigned long   latency[STAT_TYPES][STAT_BUCKETS];  // bucket i counts requests under 2^i us
+    unsigned long   full, cached;       // SELECT results sent in full and as RESULT=CACHED
+    unsigned long   delta;              // and as DELTA
+    long long       bytes, zbytes;      // full results and deltas before and after compression
+    unsigned long   stmt_hits, stmt_misses;
+    unsigned long   reconnects, failovers;  // lost connections made again, and those that took the standby
+    unsigned long   retries;            // SELECTs run again after losing their connection
+    const char      *error_source[STAT_SOURCES];
+    unsigned long   errors[STAT_SOURCES];
+} s_stats;
+
+// requests waiting for a worker (or the serial loop, see reader_main()), and the lock that
+// keeps responses whole on stdout
+typedef struct
+{
+    mutex_t         lock;
+    cond_t          ready, space;
+    s_request       *head, *tail;
+    int             count, limit;   // requests queued, no more than limit when it's set
+    int             closed;
+    int             reading;        // the reader thread is running
+    int             failed;         // a request from stdin failed, which ends the daemon: nothing more is run or sent
+    int             stats_ahead;    // STATS=1 is answered as soon as it's read (workers without --ordered)
+    unsigned long   next_seq;
+    mutex_t         output;
+    cond_t          turn;
+    int             ordered;        // --ordered, responses go out in the order of the requests
+    unsigned long   next_out;       // seq of the response that goes out next then
+    s_conn          *conns;         // what runs on them is under lock too, see conn_run()
+    int             conn_count;
+} s_pool;
+
+// one block of a result, compressed on its own by a zip pool thread (see zip_block_submit())
+typedef struct s_zip_job
+{
+    struct s_zip_job *next;     // zip pool queue
+    struct s_zip_job *after;    // the next block of the same result
+    int             codec, level, flush;
+    unsigned char   *in;        // dict_len bytes of history, then len bytes to compress
+    unsigned long   dict_len, len;
+    unsigned char   *out;
+    unsigned long   out_len;
+    unsigned long   adler;      // of the len bytes, for the zlib trailer
+    int             ret;
+    int             done;
+} s_zip_job;
+
+// compression state of a buffer with --zip-threads, blocks are stored in order as they finish
+typedef struct
+{
+    int             codec, level;
+    unsigned char   *block;     // the next block, filled after the history it starts with
+    unsigned long   dict_len, len;
+    unsigned long   adler;
+    s_zip_job       *head, *tail;
+    int             pending;
+    int             ret;
+} s_pzip;
+
+// threads compressing blocks for all buffers, started with --zip-threads
+typedef struct
+{
+    mutex_t         lock;
+    cond_t          ready, done;
+    s_zip_job       *head, *tail;
+    int             closed;
+    int             count;
+    thread_t        threads[MAX_WORKERS];
+} s_zip_pool;
+
+// what a lost connection is made again with, and the --standby connection kept ready to take over
+typedef struct
+{
+    mutex_t         lock;
+    cond_t          wake;       // the standby was taken, or it's time to stop
+    SQLHENV         henv;
+    char            *dsn;
+    SQLHDBC         dbh;        // connected and unused, NULL while the thread makes a new one
+    int             enabled;    // --standby
+    int             closed;
+    thread_t        thread;
+} s_standby;
+
 char *field_sep = "\t", *rec_sep = "\n";
+unsigned long spill_size = SPILL_SIZE;
+unsigned long zip_target = ZIP_TARGET;
+int stmt_cache_size = STMT_CACHE_SIZE;
+int group_size = 0;
+int query_timeout = 0;
+long group_window = GROUP_WINDOW;
+s_reader input;
+s_buffer std_out;
+s_pool pool;
+s_server server = {.sock = INVALID_SOCKET, .wake = INVALID_SOCKET};
+s_zip_pool zip_pool;
+s_standby standby;
+unsigned long zip_block = ZIP_BLOCK;
+s_result_cache results = {.ttl = RESULT_TTL};
+s_stats stats;
+s_cursors cursors = {.limit = CURSOR_LIMIT, .ttl = CURSOR_TTL};
+s_snapshots snapshots = {.limit = DELTA_CACHE};
 
-void sql_fetch(SQLHSTMT sth, SQLSMALLINT col_count, FILE *stream, char *md5, unsigned long *total_len);
+const char *stat_types[STAT_TYPES] = {"select", "insert", "update", "delete", "other"};
+const char *codec_names[] = {"deflate", "zstd", "lz4", "auto"};
+const char *stop_names[] = {NULL, "CANCEL", "TIMEOUT"};
+
+const char hex_digits[] = "0123456789ABCDEF";
+
+// bytes escaped by encode_buf(): control characters and the protocol delimiters
+const unsigned char encode_map[256] =
+{
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    ['"'] = 1, ['%'] = 1, [','] = 1, [';'] = 1, ['='] = 1
+};
+
+// bytes escaped by url_encode()
+const unsigned char url_map[256] =
+{
+    ['\0'] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1,
+    ['"'] = 1, ['%'] = 1, [','] = 1, [';'] = 1, ['='] = 1
+};
+
+long (*encode_mem)(unsigned char *dest, const unsigned char *src, long len);
+unsigned char encode_table[256][4];     // what encode_scalar() writes for each byte, see encode_init()
+
+int db_connect(SQLHENV henv, char *dsn, s_conn *conn);
+SQLHDBC db_open(SQLHENV henv, char *dsn, s_buffer *out);
+void db_close(s_conn *conn);
+int run_request(s_conn *conn, s_request *request, char *query, s_buffer *out);
+THREAD_PROC(worker_main, arg);
+THREAD_PROC(reader_main, arg);
+int queue_push(s_request *request);
+s_request *queue_pop(long long deadline, s_conn *conn);
+int output_lock(s_request *request);
+void output_unlock(int ok);
+int output_response(s_buffer *response, s_request *request, int ok);
+int server_start(char *address);
+void server_main(void);
+void server_accept(void);
+void server_read(s_client *client);
+void client_next(s_client *client);
+void client_send(s_buffer *response, s_request *request, int ok);
+void client_frame(s_buffer *frame, s_request *request);
+void client_queue(s_client *client, s_buffer *b, int last, int close);
+void client_flush(s_client *client);
+void server_wake(void);
+int socket_nonblocking(SOCKET sock);
+void client_close(s_client *client);
+void request_free(s_request *request);
+void request_cancel(s_request *cancel);
+int request_stopped(s_request *request);
+void conn_run(s_conn *conn, s_request *request, SQLHSTMT sth);
+int conn_lost(s_conn *conn, SQLHSTMT sth);
+int conn_dead(SQLHDBC dbh);
+int conn_getdata(s_conn *conn);
+int conn_reconnect(s_conn *conn, s_buffer *out);
+int conn_retry(s_conn *conn, SQLHSTMT *sth, int cached, RETCODE rv, s_request *request, s_buffer *out);
+int standby_start(void);
+void standby_stop(void);
+THREAD_PROC(standby_main, arg);
+int stmt_stopped(SQLHSTMT sth, RETCODE rv, s_request *request);
+int stmt_stale(SQLHSTMT sth);
+void stmt_timeout(SQLHSTMT sth, s_request *request);
+int group_member(s_request *request);
+int group_run(s_conn *conn, s_request *request);
+int group_commit(s_conn *conn);
+int group_retry(s_conn *conn);
+int group_single(s_conn *conn, s_request *request);
+void cond_wait_usec(cond_t *c, mutex_t *m, long long usec);
+int stmt_execute(s_conn *conn, char *sql, s_param *params, int param_count, SQLHSTMT *sth, s_request *request, s_buffer *out);
+int stmt_direct(s_conn *conn, char *sql, s_param *params, int param_count, SQLHSTMT *sth, s_request *request, s_buffer *out);
+SQLHSTMT stmt_prepare(s_conn *conn, char *sql, s_request *request, s_buffer *out, int *hit);
+void stmt_drop(s_stmt_cache *cache, SQLHSTMT sth);
+void stmt_cache_free(s_stmt_cache *cache);
+unsigned long hash_string(const char *str);
+void start_response(s_buffer *out, s_request *request);
+int send_rows(SQLHSTMT sth, SQLSMALLINT col_count, char *key, s_request *request, s_buffer *out);
+int send_result(s_buffer *out, s_buffer *result, char *md5, unsigned long length, s_request *request);
+void stream_chunk(s_buffer *out, s_buffer *stream, s_request *request, int last);
+void send_data(s_buffer *out, const char *name, s_buffer *data, s_request *request);
+void send_frame(s_buffer *out, s_request *request);
+void send_stats(s_buffer *out, s_request *request);
+void stats_request(char sql_type, long long usec, int sent, s_request *request, unsigned long stmt_hits, unsigned long stmt_misses);
+void stats_error(const char *source);
+void end_response(s_buffer *out, s_request *request);
+long long clock_usec(void);
+char *result_key(const char *sql, s_request *request);
+int result_get(const char *key, int ttl, s_buffer *result, char *md5, unsigned long *length, unsigned long *rows, unsigned long *generation);
+void result_put(char *key, s_buffer *result, char *md5, unsigned long length, unsigned long rows, unsigned long generation);
+void result_remove(s_result *entry);
+void result_invalidate(const char *sql);
+int delta_result(s_buffer *result, char *md5, s_request *request);
+unsigned long row_read(s_row_reader *r, unsigned char **data, int *end);
+uint64 *delta_hashes(s_buffer *result, unsigned long *rows);
+s_edit *delta_diff(const uint64 *a, long n, const uint64 *b, long m, long *count);
+int delta_write(s_buffer *result, s_edit *edits, long count, s_buffer *delta);
+uint64 *snapshot_get(const char *md5, unsigned long *rows);
+void snapshot_put(const char *md5, uint64 *hashes, unsigned long rows);
+void snapshot_remove(s_snapshot *entry);
+int cursor_reserve(void);
+void cursor_sweep(void);
+void cursor_expire(time_t now);
+void cursor_release(void);
+unsigned long cursor_open(SQLHSTMT sth, SQLHDBC dbh);
+s_cursor *cursor_take(unsigned long id);
+void cursor_put(s_cursor *cursor, int keep);
+void cursor_remove(s_cursor **link);
+void cursor_drop(SQLHDBC dbh);
+int sql_table(const char *sql, char *table, int size);
+int sql_mentions(const char *sql, const char *name);
+int sql_retry(const char *sql);
+int params_parse(char *str, s_param **params);
+int params_bind(SQLHSTMT sth, s_param *params, int count, s_buffer *out);
+int bulk_run(s_conn *conn, char *sql, s_request *request, s_buffer *out);
+char *bulk_field(char **p, long *len, int *end);
+int bulk_fill(s_bulk_col *cols, int col_count, char **fields, long *lens, unsigned long n, const char **src);
+RETCODE bulk_execute(SQLHSTMT sth, s_bulk_col *cols, int col_count, unsigned long n, SQLUSMALLINT *status, SQLLEN *row_count, unsigned long *written, const char **src);
+void sql_fetch(SQLHSTMT sth, SQLSMALLINT col_count, s_buffer *stream, char *md5, unsigned long *total_len, s_request *request);
+int sql_fetch_block(SQLHSTMT sth, SQLSMALLINT col_count, s_col_data *col_data, s_buffer *stream, s_digest *digest, unsigned long *total_len, int rows, int zip, unsigned char *buffer, SQLLEN buffer_size, s_request *request);
+int sql_get_cell(SQLHSTMT sth, SQLUSMALLINT i, SQLSMALLINT type, unsigned char *buffer, SQLLEN buffer_size, s_buffer *stream, s_digest *digest, unsigned long *total_len, s_column *col);
+void columnar_init(s_columnar *c, SQLSMALLINT col_count, s_col_data *col_data, s_buffer *stream, s_digest *digest, unsigned long *total_len);
+void columnar_put(s_column *col, const void *value, SQLLEN len);
+void columnar_end(s_column *col, int valid);
+void columnar_row(s_columnar *c);
+void columnar_flush(s_columnar *c);
+void columnar_free(s_columnar *c);
+void columnar_write(s_columnar *c, const void *data, unsigned long len);
+void columnar_buffer(s_columnar *c, s_bytes *b);
+void columnar_u64(s_columnar *c, unsigned long long v);
+void bytes_add(s_bytes *b, const void *data, unsigned long len);
+void bytes_le(s_bytes *b, const void *value, int size);
+void digest_init(s_digest *digest, int type);
+void digest_update(s_digest *digest, unsigned char *data, unsigned len);
+void digest_final(s_digest *digest, char *hex);
 int get_request(s_request *request);
+void reader_room(s_reader *r);
+int request_parse(s_reader *r, long term, s_request *request);
+long request_end(s_reader *r);
+int set_request_field(s_request *request, const char *key, const char *value, unsigned long len);
+void store_string(char **dest, unsigned long *size, const char *value, unsigned long len);
+#if defined(WIN32)
 void temp_file_name(char *tmpnam);
-int error(char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h);
+#endif
+FILE *spill_file(void);
+int error(s_buffer *out, const char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h);
 char *url_encode(const char *src, int len, int force, char *buffer);
-long encode_out(FILE *stream, unsigned char *b, long len);
-int oddie_deflate(FILE *source, FILE *dest, int level);
+long encode_buf(s_buffer *dest, unsigned char *b, long len, int binary);
+void encode_init(void);
+long encode_scalar(unsigned char *dest, const unsigned char *src, long len);
+#if defined(ENCODE_SIMD)
+long encode_sse2(unsigned char *dest, const unsigned char *src, long len);
+long encode_avx2(unsigned char *dest, const unsigned char *src, long len);
+int encode_dense(unsigned int escapes, int limit);
+unsigned char *encode_block(unsigned char *d, const unsigned char *block, unsigned int escapes, int width);
+#endif
+void buf_init(s_buffer *b);
+void buf_init_file(s_buffer *b, FILE *file);
+void buf_write(s_buffer *b, const void *data, unsigned long len);
+unsigned long buf_room(s_buffer *b, unsigned char **room);
+void buf_wrote(s_buffer *b, unsigned long len);
+void buf_store(s_buffer *b, const void *data, unsigned long len);
+void buf_puts(s_buffer *b, const char *str);
+void buf_printf(s_buffer *b, const char *format, ...);
+void buf_flush(s_buffer *b);
+void buf_output(s_buffer *b, FILE *stream);
+void buf_rewind(s_buffer *b);
+unsigned long buf_read(s_buffer *b, void *data, unsigned long len);
+void buf_free(s_buffer *b);
+void buf_clear(s_buffer *b);
+int codec_parse(const char *name);
+int zip_policy(int zip, int codec, unsigned long length);
+void zip_start(s_buffer *b, s_request *request, unsigned long length);
+void zip_probe(s_buffer *stream, s_request *request, unsigned long length);
+void zip_adapt(s_buffer *b, s_request *request);
+unsigned long zip_once(int codec, int level, const unsigned char *in, unsigned long len, unsigned char *out, unsigned long size);
+void send_zip(s_buffer *out, s_request *request);
+int oddie_deflate(s_buffer *b, int codec, int level);
+int oddie_deflate_write(s_buffer *b, const void *data, unsigned long len, int flush);
+int oddie_deflate_end(s_buffer *b);
+void oddie_deflate_free(s_buffer *b);
+int zip_pool_start(int count);
+void zip_pool_stop(void);
+THREAD_PROC(zip_worker, arg);
+void zip_job_run(s_zip_job *job);
+s_pzip *zip_parallel_init(int codec, int level);
+int zip_parallel_write(s_buffer *b, const void *data, unsigned long len, int flush);
+void zip_block_submit(s_pzip *pz, int flush);
+void zip_block_collect(s_buffer *b, int keep);
+void zip_parallel_free(s_pzip *pz);
 void cleanup(SQLHENV henv, SQLHDBC dbh, SQLHSTMT sth);
 
 int main(int argc, char *argv[])
 {
     RETCODE       rv;
-    SQLSMALLINT   col_count, i;
-    SQLINTEGER    row_count;
     SQLHENV       henv = SQL_NULL_HENV;
-    SQLHDBC       dbh = SQL_NULL_HDBC;
-    SQLHSTMT      sth = SQL_NULL_HSTMT;
-    FILE          *stream, *zstream;
-    s_request     request = {0};
-    int           argi = 1;
-    unsigned long length;
-    unsigned char buffer[1024 + 1], daemon = 0;
-    char          md5[33], *query = NULL, *encoded = NULL, filename[MAX_PATH], zfilename[MAX_PATH];
+    s_conn        conns[MAX_WORKERS] = {{0}};
+    s_request     request = {0}, *queued, *current;
+    s_worker      workers[MAX_WORKERS];
+    int           argi = 1, worker_count = 1, zip_threads = 1, read_ahead = READ_AHEAD, n = 0, ok;
+    unsigned char daemon = 0;
+    thread_t      reader;
+    char          *query = NULL, *listen_on = NULL;
 
     SET_BINARY_MODE(stdout);
+    encode_init();
+    buf_init_file(&std_out, stdout);
+    mutex_init(&stats.lock);
+
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0)
+    {
+        if (strcmp(argv[argi], "--spill") == 0 && argi + 1 < argc)
+            spill_size = strtoul(argv[++argi], NULL, 10);
+        else if (strcmp(argv[argi], "--workers") == 0 && argi + 1 < argc)
+            worker_count = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--listen") == 0 && argi + 1 < argc)
+            listen_on = argv[++argi];
+        else if (strcmp(argv[argi], "--read-ahead") == 0 && argi + 1 < argc)
+            read_ahead = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--standby") == 0)
+            standby.enabled = 1;
+        else if (strcmp(argv[argi], "--ordered") == 0)
+        {
+            pool.ordered = 1;
+            argi++;
+            continue;
+        }
+        else if (strcmp(argv[argi], "--group-commit") == 0 && argi + 1 < argc)
+            group_size = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--group-window") == 0 && argi + 1 < argc)
+            group_window = atol(argv[++argi]);
+        else if (strcmp(argv[argi], "--timeout") == 0 && argi + 1 < argc)
+            query_timeout = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--stmt-cache") == 0 && argi + 1 < argc)
+            stmt_cache_size = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--result-cache") == 0 && argi + 1 < argc)
+            results.limit = strtoul(argv[++argi], NULL, 10);
+        else if (strcmp(argv[argi], "--result-ttl") == 0 && argi + 1 < argc)
+            results.ttl = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--cursors") == 0 && argi + 1 < argc)
+            cursors.limit = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--cursor-ttl") == 0 && argi + 1 < argc)
+            cursors.ttl = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--delta-cache") == 0 && argi + 1 < argc)
+            snapshots.limit = strtoul(argv[++argi], NULL, 10);
+        else if (strcmp(argv[argi], "--zip-target") == 0 && argi + 1 < argc)
+            zip_target = strtoul(argv[++argi], NULL, 10);
+        else if (strcmp(argv[argi], "--zip-threads") == 0 && argi + 1 < argc)
+            zip_threads = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--zip-block") == 0 && argi + 1 < argc)
+            zip_block = strtoul(argv[++argi], NULL, 10);
+        else
+            argi = argc;
+
+        argi++;
+    }
 
-    if (argc < 2 || !argv[argi])
+    if (argi >= argc || !argv[argi] || worker_count < 1 || worker_count > MAX_WORKERS || stmt_cache_size < 0 || read_ahead < 0
+        || zip_threads < 1 || zip_threads > MAX_WORKERS || zip_block < 4096 || group_size < 0 || group_window < 0 || query_timeout < 0)
     {
-        printf("usage: %s dsn_string [sql]", argv[0]);
+        printf("usage: %s [--spill bytes] [--listen port|host:port|path] [--workers n] [--ordered] [--read-ahead n] [--group-commit n] [--group-window ms] [--timeout seconds] [--standby] [--stmt-cache n] [--result-cache bytes] [--result-ttl seconds] [--cursors n] [--cursor-ttl seconds] [--delta-cache bytes] [--zip-target MB/s] [--zip-threads n] [--zip-block bytes] dsn_string [sql]", argv[0]);
         exit(0);
     }
     else if (!argv[argi + 1])
     {
         daemon = 1;
-        query = request.sql;
 #if defined(WIN32)
         SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
 #endif
     }
     else
+    {
         query = argv[argi + 1];
+        worker_count = 1;
+        listen_on = NULL;
+        standby.enabled = 0;
+    }
+
+    // a group waits for more writes in the queue, which a single request or reading stdin
+    // between requests doesn't have
+    if (!daemon || (worker_count == 1 && !read_ahead && !listen_on))
+        group_size = 0;
+
+    mutex_init(&results.lock);
+    mutex_init(&cursors.lock);
+    cond_init(&cursors.idle);
+    mutex_init(&standby.lock);
+    cond_init(&standby.wake);
+    mutex_init(&snapshots.lock);
+    mutex_init(&pool.lock);
+    mutex_init(&pool.output);
+    cond_init(&pool.ready);
+    cond_init(&pool.space);
+    cond_init(&pool.turn);
+    pool.limit = read_ahead;
+    pool.conns = conns;
+    pool.conn_count = (worker_count > 1 || listen_on ? worker_count : 1);
+
+    // clients take turns on the connections, each request goes to whichever worker is free
+    // (a client's next one waits for its response, see client_next())
+    if (listen_on)
+        pool.limit = 0;
+
+    // a single thread compresses inline, as it always has
+    if (zip_threads > 1 && !zip_pool_start(zip_threads))
+        goto CLEANUP;
 
     rv = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv);
-    if (error("SQLAllocHandle1", rv, SQL_HANDLE_ENV, henv))
+    if (error(&std_out, "SQLAllocHandle1", rv, SQL_HANDLE_ENV, henv))
         goto CLEANUP;
 
-    rv = SQLSetEnvAttr(henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC2, SQL_IS_INTEGER);
-    if (error("SQLSetEnvAttr", rv, SQL_HANDLE_ENV, henv))
+    rv = SQLSetEnvAttr(henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, SQL_IS_INTEGER);
+    if (error(&std_out, "SQLSetEnvAttr", rv, SQL_HANDLE_ENV, henv))
         goto CLEANUP;
 
     rv = SQLSetEnvAttr(henv, SQL_ATTR_CONNECTION_POOLING, (SQLPOINTER) SQL_CP_ONE_PER_DRIVER, SQL_IS_INTEGER);
-    if (error("SQLSetEnvAttr", rv, SQL_HANDLE_ENV, henv))
+    if (error(&std_out, "SQLSetEnvAttr", rv, SQL_HANDLE_ENV, henv))
         goto CLEANUP;
 
-    rv = SQLAllocHandle(SQL_HANDLE_DBC, henv, &dbh);
-    if (error("SQLAllocHandle2", rv, SQL_HANDLE_ENV, henv) || !dbh)
+    if (!db_connect(henv, argv[argi], &conns[0]))
+        goto CLEANUP;
+
+    // lost connections are made again the same way
+    standby.henv = henv;
+    standby.dsn = argv[argi];
+
+    if (listen_on && !server_start(listen_on))
         goto CLEANUP;
 
-    rv = SQLDriverConnect(dbh, NULL, (SQLCHAR *) argv[argi], SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT);
-    if (error("SQLDriverConnect", rv, SQL_HANDLE_DBC, dbh))
+    if (worker_count > 1 || listen_on)
+    {
+        // every worker gets its own connection, the first one reuses the one above
+        for (n = 0; n < worker_count; n++)
+        {
+            workers[n].conn = &conns[n];
+
+            if (n && !db_connect(henv, argv[argi], &conns[n]))
+                goto CLEANUP;
+        }
+    }
+
+    if (standby.enabled && !standby_start())
         goto CLEANUP;
 
     if (daemon)
@@ -135,559 +950,5390 @@ int main(int argc, char *argv[])
         fflush(stdout);
     }
 
-    for (;;)
+    if (worker_count > 1 || listen_on)
     {
-        if ((daemon && !get_request(&request)) || !query[0])
-            break;
-
-        char *sql = query;
-        while (sql[0] < 33)
-            sql++;
-        char sql_type = tolower(sql[0]);
+        for (n = 0; n < worker_count; n++)
+            if (!thread_create(&workers[n].thread, worker_main, &workers[n]))
+                goto CLEANUP;
 
-        row_count = col_count = -1;
+        // clients instead of stdin, until the process is stopped
+        if (listen_on)
+            server_main();
+        else
+        {
+            // requests go out to whichever worker is free, responses come back in completion order
+            // (or request order with --ordered); stdin is read by a thread of its own, so a failed
+            // request ends the daemon without waiting for more input
+            pool.reading = 1;
+            pool.stats_ahead = !pool.ordered;
 
-        rv = SQLAllocHandle(SQL_HANDLE_STMT, dbh, &sth);
-        if (error("SQLAllocHandle3", rv, SQL_HANDLE_DBC, dbh) || !sth)
-            goto CLEANUP;
+            if (!thread_create(&reader, reader_main, NULL))
+                pool.reading = 0;
+        }
 
-        if (sql_type == 't')
+        // the workers finish what's running and stop, once the queue is closed and empty: at the end
+        // of the input, or right after a failed request
+        if (listen_on || !pool.reading)
         {
-            // list tables
-            //~ https://learn.microsoft.com/en-us/sql/odbc/reference/syntax/sqltables-function?view=sql-server-ver16
+            mutex_lock(&pool.lock);
+            pool.closed = 1;
+            cond_broadcast(&pool.ready);
+            mutex_unlock(&pool.lock);
+        }
 
-            //~ int numCols = 5;
-            //~ DataBinding *catalogResult = (struct DataBinding *) malloc(numCols * sizeof(struct DataBinding));
+        for (n = 0; n < worker_count; n++)
+            thread_join(workers[n].thread);
 
-            //~ // allocate memory for the binding - free this memory when done
-            //~ for (i = 0; i < numCols; i++)
-            //~ {
-                //~ catalogResult[i].TargetType = SQL_C_CHAR;
-                //~ catalogResult[i].BufferLength = (1024 + 1);
-                //~ catalogResult[i].TargetValuePtr = malloc(sizeof(unsigned char) * catalogResult[i].BufferLength);
-            //~ }
+        mutex_lock(&pool.lock);
+        n = pool.reading;
+        mutex_unlock(&pool.lock);
 
-            //~ // setup the binding (can be used even if the statement is closed by closeStatementHandle)
-            //~ for (i = 0 ; i < numCols ; i++)
-                //~ rv = SQLBindCol(sth, (SQLUSMALLINT) i + 1, catalogResult[i].TargetType, catalogResult[i].TargetValuePtr, catalogResult[i].BufferLength, &(catalogResult[i].StrLen_or_Ind));
+        // after a failed request the reader can still be waiting for input, it goes with the process
+        if (n)
+            input.buf = NULL;
+        else if (!listen_on)
+            thread_join(reader);
+    }
+    else
+    {
+        // the requests after this one are read and parsed by a thread of their own, into the queue
+        if (daemon && read_ahead)
+        {
+            pool.reading = 1;
 
-// output header row
-//~ for (i = 1; i <= col_count; i++)
-//~ {
-    //~ buffer = (unsigned char *) url_encode((char *) col_data[i].col_name, strlen((char *) col_data[i].col_name), 0, NULL);
-    //~ fputs((char *) buffer, stream);
-    //~ free(buffer);
-    //~ if (i < col_count)
-        //~ fputs(field_sep, stream);  encode_out(stdout, field_sep, 1);
+            if (!thread_create(&reader, reader_main, NULL))
+            {
+                pool.reading = 0;
+                goto CLEANUP;
+            }
+        }
 
-//~ }
+        for (;;)
+        {
+            current = &request;
 
-//~ fputs(rec_sep, stream); encode_out(stdout, rec_sep, 1);
+            if (daemon)
+            {
+                if (read_ahead)
+                {
+                    // a group is committed once no more writes have turned up for it in time
+                    if (!(current = queue_pop(conns[0].group.count ? conns[0].group.started + group_window * 1000 : 0, &conns[0])))
+                    {
+                        if (!conns[0].group.count || !group_commit(&conns[0]))
+                            break;
 
-//~ fputs("RESULT=\"", stdout);
-//~ while ((i = fread(buffer, 1, 1024, stream)))
-    //~ encode_out(stdout, buffer, i);
-//~ fputs("\";", stdout);
+                        continue;
+                    }
+                }
+                else if (!get_request(&request))
+                    break;
 
-//~ for (;;)
-//~ {
-    //~ rv = SQLFetch(sth);
+                // nothing runs while stdin is read here, so there's nothing to stop (the reader
+                // thread takes care of them with --read-ahead)
+                if (current->cancel[0])
+                    continue;
 
-    //~ if (IS_SQL_SUCCESS(rv))
-    //~ {
-        //~ for (i = 1; i <= col_count; i++)
-        //~ {
-            //~ for (;;)
-            //~ {
-                //~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
+                if (group_member(current))
+                {
+                    if (!group_run(&conns[0], current))
+                        break;
 
-                //~ if (IS_SQL_SUCCESS(rv) && copy_len != SQL_NULL_DATA && copy_len != 0)
-                //~ {
-                    //~ copy_len = ((SQLUINTEGER) copy_len > buffer_size) || (copy_len == SQL_NO_TOTAL) ? (SQLINTEGER) buffer_size : copy_len;
-                    //~ *total_len += encode_out(stream, buffer, copy_len);
-                    //~ MD5Update(&md5_state, buffer, copy_len);
+                    continue;
+                }
 
-                    //~ if (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &status_size) != SQL_NO_DATA)
-                        //~ continue;
-                //~ }
+                // anything else, STATS too, goes out after the writes before it
+                if (!group_commit(&conns[0]))
+                    break;
 
-                //~ break;
-            //~ }
+                if (current->stats)
+                {
+                    conn_run(&conns[0], NULL, SQL_NULL_HSTMT);
+                    send_stats(&std_out, current);
 
-//~ do {
-//~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
-//~ } while (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &statuslen) != SQL_NO_DATA);
+                    if (current != &request)
+                        request_free(current);
 
-            //~ if (i < col_count)
-                //~ fputs(field_sep, stream);
-        //~ }
+                    continue;
+                }
 
-        //~ fputs(rec_sep, stream);
-    //~ }
-    //~ else
-        //~ break;
-//~ }
+                query = current->sql;
+            }
 
-            // all catalogs query
-            //~ printf("table\n");
-            //~ rv = SQLTables(sth, (SQLCHAR *) SQL_ALL_CATALOGS, SQL_NTS, (SQLCHAR *) "", SQL_NTS, (SQLCHAR *) "", SQL_NTS, (SQLCHAR *) "", SQL_NTS);
-            //~ for (rv = SQLFetch(sth); IS_SQL_SUCCESS(rv); rv = SQLFetch(sth))
-                //~ if (catalogResult[0].StrLen_or_Ind != SQL_NULL_DATA)
-                    //~ printf("%s\n", (char *) catalogResult[0].TargetValuePtr);
+            if (!query[0] && !current->cursor)
+                break;
 
-            //~ for (i = 0; i < numCols; i++)
-                //~ free(catalogResult[i].TargetValuePtr);
-            //~ free(catalogResult);
-        }
-        else
-        {
-            // select/insert/update/delete
-            rv = SQLExecDirect(sth, (UCHAR *) sql, SQL_NTS);
-            if (error("SQLExecDirect", rv, SQL_HANDLE_STMT, sth))
-                goto CLEANUP;
+            ok = run_request(&conns[0], current, query, &std_out);
 
-            rv = SQLNumResultCols(sth, &col_count);
-            if (error("SQLNumResultCols", rv, SQL_HANDLE_STMT, sth) || col_count < 0)
-                goto CLEANUP;
+            if (current != &request)
+                request_free(current);
 
-            rv = SQLRowCount(sth, &row_count);
-            if (error("SQLRowCount", rv, SQL_HANDLE_STMT, sth))
-                goto CLEANUP;
+            if (!ok || !daemon)
+                break;
+        }
 
-            if (request.id[0])
-            {
-                encoded = url_encode(request.id, strlen(request.id), 0, NULL);
-                printf("ID=\"%s\",", encoded);
-                free(encoded);
-            }
+        if (daemon && read_ahead)
+        {
+            mutex_lock(&pool.lock);
+            pool.closed = 1;
+            cond_broadcast(&pool.space);
+            n = pool.reading;
+            mutex_unlock(&pool.lock);
 
-            if ((sql_type == 'i' || sql_type == 'u' || sql_type == 'd') && row_count > -1)
-            {
-                // insert/update/delete
-                // ODBC specifies SQLRowCount() only returns a value on INSERT/UPDATE/DELETE
-                // but MariaDB ODBC connector doesn't adhere to the spec, hence the special case code
-                // they thought they were clever. they were, but they were wrong
-                // only return ROWCOUNT according to the ODBC spec
-                printf("ROWCOUNT=%d;", (int) row_count);
-            }
-            else if (col_count < 1)
-            {
-                // select without results
-                fputs("RESULT=\"\";", stdout);
-            }
+            // after a failed request the reader can still be waiting for input, it goes with the process
+            if (n)
+                input.buf = NULL;
             else
-            {
-                // select with results
-                filename[0] = 0;
-                temp_file_name(filename);
+                thread_join(reader);
 
-                stream = fopen(filename, "wb");
-                sql_fetch(sth, col_count, stream, md5, &length); // xxx length is total char length of returned data
-                fclose(stream);
+            while ((queued = queue_pop(0, NULL)))
+                request_free(queued);
+        }
+    }
 
-                printf("MD5=%s,", md5);
+    CLEANUP:
+    if (server.sock != INVALID_SOCKET)
+        socket_close(server.sock);
 
-                if (request.md5[0] && strcmp(md5, request.md5) == 0)
-                {
-                    fputs("RESULT=CACHED;", stdout);
-                }
-                else
-                {
-                    if (length < 128)
-                        request.zip = 0;
-                    else if (request.zip)
-                        request.zip = (length < 512 ? 5 : 9);
+    if (server.wake != INVALID_SOCKET)
+        socket_close(server.wake);
 
-                    if (request.zip)
-                    {
-                        printf("ZIP=%d,", request.zip);
+    // cursor statements go before their connections
+    while (cursors.head)
+        cursor_remove(&cursors.head);
 
-                        zfilename[0] = 0;
-                        temp_file_name(zfilename);
+    standby_stop();
 
-                        stream = fopen(filename, "rb");
-                        zstream = fopen(zfilename, "wb");
+    for (n = 0; n < MAX_WORKERS; n++)
+    {
+        free(conns[n].group.requests);
+        free(conns[n].group.responses);
+        db_close(&conns[n]);
+    }
 
-                        rv = oddie_deflate(stream, zstream, request.zip);
+    cleanup(henv, SQL_NULL_HDBC, SQL_NULL_HSTMT);
 
-                        fclose(stream);
-                        fclose(zstream);
+    while (results.head)
+        result_remove(results.head);
 
-                        stream = fopen(zfilename, "rb");
-                    }
-                    else
-                        stream = fopen(filename, "rb");
+    while (snapshots.head)
+        snapshot_remove(snapshots.head);
 
-                    fputs("RESULT=\"", stdout);
+    mutex_destroy(&results.lock);
+    mutex_destroy(&cursors.lock);
+    cond_destroy(&cursors.idle);
+    mutex_destroy(&standby.lock);
+    cond_destroy(&standby.wake);
+    mutex_destroy(&snapshots.lock);
+    mutex_destroy(&pool.lock);
+    mutex_destroy(&pool.output);
+    cond_destroy(&pool.ready);
+    cond_destroy(&pool.space);
+    cond_destroy(&pool.turn);
+    zip_pool_stop();
+    free(request.sql);
+    free(request.params);
+    free(input.buf);
 
-                    while ((i = fread(buffer, 1, 1024, stream)))
-                        encode_out(stdout, buffer, i);
+    return 0;
+}
 
-                    fputs("\";", stdout);
+int db_connect(SQLHENV henv, char *dsn, s_conn *conn)
+{
+    memset(conn, 0, sizeof(s_conn));
+    conn->cache.size = stmt_cache_size;
 
-                    fclose(stream);
+    return ((conn->dbh = db_open(henv, dsn, &std_out)) != SQL_NULL_HDBC);
+}
 
-                    if (request.zip)
-                        DeleteFile(zfilename);
-                }
+// a new connection, NULL if it couldn't be made (the error is written to out, if there's one)
+SQLHDBC db_open(SQLHENV henv, char *dsn, s_buffer *out)
+{
+    SQLHDBC dbh = SQL_NULL_HDBC;
+    RETCODE rv;
 
-                DeleteFile(filename);
-            }
+    rv = SQLAllocHandle(SQL_HANDLE_DBC, henv, &dbh);
+    if (!IS_SQL_SUCCESS(rv) || !dbh)
+    {
+        if (out)
+            error(out, "SQLAllocHandle2", rv, SQL_HANDLE_ENV, henv);
 
-            fflush(stdout);
-        }
+        return SQL_NULL_HDBC;
+    }
 
-        SQLFreeHandle(SQL_HANDLE_STMT, sth);
-        sth = SQL_NULL_HSTMT;
+    rv = SQLDriverConnect(dbh, NULL, (SQLCHAR *) dsn, SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT);
+    if (!IS_SQL_SUCCESS(rv))
+    {
+        if (out)
+            error(out, "SQLDriverConnect", rv, SQL_HANDLE_DBC, dbh);
 
-        if (!daemon)
-            break;
+        SQLFreeHandle(SQL_HANDLE_DBC, dbh);
+        return SQL_NULL_HDBC;
     }
 
-    CLEANUP:
-    cleanup(henv, dbh, sth);
+    return dbh;
+}
 
-    return 0;
+// prepared statements have to go before the connection does
+void db_close(s_conn *conn)
+{
+    stmt_cache_free(&conn->cache);
+    cleanup(SQL_NULL_HENV, conn->dbh, SQL_NULL_HSTMT);
+    conn->dbh = SQL_NULL_HDBC;
 }
 
-void sql_fetch(SQLHSTMT sth, SQLSMALLINT col_count, FILE *stream, char *md5, unsigned long *total_len)
+// --standby: keep a connection open for the first one that's lost, see conn_reconnect()
+int standby_start(void)
 {
-    SQLSMALLINT i, status, status_size;
-    SQLRETURN rv;
-    SQLINTEGER copy_len;
-    unsigned char *buffer;
-    MD5Context md5_state;
-    s_col_data *col_data = (s_col_data *) malloc((col_count + 1) * sizeof(s_col_data));
-    SQLUINTEGER buffer_size = 0;
-    unsigned char md5_raw[16];
-    unsigned char has_blob = 0;
+    if (!thread_create(&standby.thread, standby_main, NULL))
+    {
+        standby.enabled = 0;
+        return 0;
+    }
 
-    // col 0 is the bookmark column
-    // get info for each col
+    return 1;
+}
 
-    for (i = 1; i <= col_count; i++)
-    {
-        rv = SQLDescribeCol(sth, i,
-                            col_data[i].col_name,
-                            sizeof(col_data[i].col_name),
-                            &(col_data[i].col_name_len),
-                            &(col_data[i].data_type),
-                            &(col_data[i].col_size),
-                            &(col_data[i].decimal_digits),
-                            &(col_data[i].nullable));
+void standby_stop(void)
+{
+    if (!standby.enabled)
+        return;
 
-        //if (error(rv, SQL_HANDLE_STMT, sth))
-        //    log("problem binding column %d name: %s\n", i, col_data[i].col_name);
+    mutex_lock(&standby.lock);
+    standby.closed = 1;
+    cond_signal(&standby.wake);
+    mutex_unlock(&standby.lock);
 
-        if (col_data[i].col_size > buffer_size)
-            buffer_size = col_data[i].col_size;
+    thread_join(standby.thread);
+    cleanup(SQL_NULL_HENV, standby.dbh, SQL_NULL_HSTMT);
+    standby.dbh = SQL_NULL_HDBC;
+    standby.enabled = 0;
+}
 
-        switch (col_data[i].data_type)
+/*
+ * Connects the standby and then waits for it to be taken, looking every STANDBY_CHECK
+ * seconds whether it's still alive. While the server can't be reached it tries again
+ * at that pace too.
+ */
+THREAD_PROC(standby_main, arg)
+{
+    SQLHDBC dbh;
+
+    (void) arg;
+
+    mutex_lock(&standby.lock);
+
+    while (!standby.closed)
+    {
+        if (!standby.dbh)
         {
-            case SQL_LONGVARCHAR:
-                col_data[i].data_type = SQL_CHAR;
-                has_blob = 1;
-                break;
-            case SQL_BINARY:
-            case SQL_VARBINARY:
-            case SQL_LONGVARBINARY:
-                col_data[i].data_type = SQL_C_BINARY;
-                has_blob = 1;
-                break;
-            default:
-                col_data[i].data_type = SQL_C_CHAR;
-                break;
+            // the handshake is what the standby is there to get out of the way
+            mutex_unlock(&standby.lock);
+            dbh = db_open(standby.henv, standby.dsn, NULL);
+            mutex_lock(&standby.lock);
+
+            if ((standby.dbh = dbh))
+                continue;
+        }
+        else if (conn_dead(standby.dbh))
+        {
+            cleanup(SQL_NULL_HENV, standby.dbh, SQL_NULL_HSTMT);
+            standby.dbh = SQL_NULL_HDBC;
+            continue;
         }
+
+        if (!standby.closed)
+            cond_wait_usec(&standby.wake, &standby.lock, STANDBY_CHECK * 1000000LL);
     }
 
-    // output header row
-    for (i = 1; i <= col_count; i++)
+    mutex_unlock(&standby.lock);
+
+    return 0;
+}
+
+/*
+ * Run one statement on conn and write the complete response to out.
+ * Returns 0 if the request failed in a way that ends the daemon.
+ */
+int run_request(s_conn *conn, s_request *request, char *query, s_buffer *out)
+{
+    RETCODE       rv;
+    SQLSMALLINT   col_count;
+    SQLLEN        row_count;
+    SQLHSTMT      sth = SQL_NULL_HSTMT;
+    s_buffer      result;
+    s_cursor      *cursor;
+    unsigned long length;
+    char          md5[33], *key = NULL;
+    s_param       *params = NULL;
+    int           ok = 0, cached = 0, param_count = 0, reserved = 0, sent = -1;
+    long long     start, began = clock_usec();
+    int           ttl = (request->ttl >= 0 ? request->ttl : results.ttl);
+    int           timeout = (request->timeout >= 0 ? request->timeout : query_timeout);
+    unsigned long stmt_hits = conn->cache.hits, stmt_misses = conn->cache.misses;
+
+    char *sql = query;
+    while (sql[0] && sql[0] < 33)
+        sql++;
+    char sql_type = (request->cursor ? 's' : tolower(sql[0]));
+
+    row_count = col_count = -1;
+    request->more = 0;
+    request->retry = (sql_type == 's' && !request->cursor && sql_retry(sql));
+    request->getdata = conn_getdata(conn);
+    request->deadline = (timeout > 0 ? began + timeout * 1000000LL : 0);
+
+    if (sql_type != 't')
+        start_response(out, request);
+
+    // CANCEL= can get to it from now on, or already has while it was queued
+    conn_run(conn, request, SQL_NULL_HSTMT);
+
+    if (request->stopped)
     {
-        buffer = (unsigned char *) url_encode((char *) col_data[i].col_name, strlen((char *) col_data[i].col_name), 0, NULL);
-        fputs((char *) buffer, stream);
-        free(buffer);
-        if (i < col_count)
-            fputs(field_sep, stream);
+        error(out, stop_names[request->stopped], SQL_ERROR, SQL_HANDLE_STMT, SQL_NULL_HSTMT);
+        goto CLEANUP;
     }
 
-    fputs(rec_sep, stream);
+    cursor_sweep();
 
-    *total_len = 0;
+    // a connection lost by the request before, or one the driver knows is dead by now, is made again first
+    if ((conn->lost || conn_dead(conn->dbh)) && (!conn_reconnect(conn, out) || conn->group.count))
+    {
+        // the writes of a group before this one went with it, group_retry() runs them all again
+        ok = !conn->group.count;
+        goto CLEANUP;
+    }
 
-    MD5Init(&md5_state);
+    // the next page of an open cursor, from the statement it left on its connection
+    if (request->cursor)
+    {
+        // an expired or unknown cursor is the client's problem, the daemon carries on
+        if (!(cursor = cursor_take(request->cursor)))
+        {
+            error(out, "CURSOR", SQL_ERROR, SQL_HANDLE_STMT, SQL_NULL_HSTMT);
+            ok = 1;
+            goto CLEANUP;
+        }
 
-    // increase column size for binary fields, and because of some misreporting of length
-    buffer_size = (buffer_size * 2) + 128;
-    if (has_blob && buffer_size < 32768)
-        buffer_size = 32768;
-    buffer = (unsigned char *) malloc(buffer_size);
+        // FETCH=0 just closes it
+        if (request->fetch)
+        {
+            conn_run(conn, request, cursor->sth);
 
-    for (;;)
+            rv = SQLNumResultCols(cursor->sth, &col_count);
+            if (error(out, "SQLNumResultCols", rv, SQL_HANDLE_STMT, cursor->sth))
+            {
+                cursor_put(cursor, 0);
+                goto CLEANUP;
+            }
+
+            sent = send_rows(cursor->sth, col_count, NULL, request, out);
+            conn_run(conn, request, SQL_NULL_HSTMT);
+
+            // the rest of its rows go with it
+            if (request->stopped)
+            {
+                cursor_put(cursor, 0);
+                goto CLEANUP;
+            }
+
+            if (request->more)
+                buf_printf(out, ",CURSOR=%lu", request->cursor);
+        }
+        else
+            buf_puts(out, "RESULT=\"\"");
+
+        cursor_put(cursor, request->more);
+        end_response(out, request);
+        ok = 1;
+        goto CLEANUP;
+    }
+
+    // fresh SELECT results come from the result cache, without touching the database
+    if (results.limit && sql_type == 's' && ttl > 0 && !request->stream && !request->fetch)
     {
-        rv = SQLFetch(sth);
+        key = result_key(sql, request);
 
-        if (IS_SQL_SUCCESS(rv))
+        if (result_get(key, ttl, &result, md5, &length, &request->times.rows, &request->generation))
         {
-            for (i = 1; i <= col_count; i++)
-            {
-                for (;;)
-                {
-                    rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
+            result.ztime = (request->timing ? &request->times.compress : NULL);
+            sent = send_result(out, &result, md5, length, request);
+            end_response(out, request);
+            ok = 1;
+            goto CLEANUP;
+        }
+    }
 
-                    if (IS_SQL_SUCCESS(rv) && copy_len != SQL_NULL_DATA && copy_len != 0)
-                    {
-                        copy_len = ((SQLUINTEGER) copy_len > buffer_size) || (copy_len == SQL_NO_TOTAL) ? (SQLINTEGER) buffer_size : copy_len;
-                        *total_len += encode_out(stream, buffer, copy_len);
-                        MD5Update(&md5_state, buffer, copy_len);
+    // BULK rows are run in arrays on a statement of their own
+    // the batches before a failed one stay written, so their results go either way
+    if (request->bulk)
+    {
+        ok = bulk_run(conn, sql, request, out);
 
-                        if (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &status_size) != SQL_NO_DATA)
-                            continue;
-                    }
+        if (results.limit)
+            result_invalidate(sql);
 
-                    break;
-                }
+        goto CLEANUP;
+    }
+
+    start = timer_start(request);
+
+    if (request->params && (param_count = params_parse(request->params, &params)) < 0)
+    {
+        error(out, "PARAMS", SQL_ERROR, SQL_HANDLE_STMT, SQL_NULL_HSTMT);
+        goto CLEANUP;
+    }
+
+    request->times.parse += timer_stop(request, start);
+
+    // a SELECT with FETCH=n may leave a cursor open, make sure there's room for it first
+    if (request->fetch && sql_type == 's' && !(reserved = cursor_reserve()))
+    {
+        error(out, "CURSOR_LIMIT", SQL_ERROR, SQL_HANDLE_STMT, SQL_NULL_HSTMT);
+        ok = 1;
+        goto CLEANUP;
+    }
+
+    // statements go through the connection's prepared statement cache, unless it's turned off
+    // a cursor needs a statement of its own, it stays open after this request
+    cached = (conn->cache.size > 0 && sql_type != 't' && !reserved);
+
+    if (sql_type == 't')
+    {
+        // list tables
+        //~ https://learn.microsoft.com/en-us/sql/odbc/reference/syntax/sqltables-function?view=sql-server-ver16
+
+        //~ int numCols = 5;
+        //~ DataBinding *catalogResult = (struct DataBinding *) malloc(numCols * sizeof(struct DataBinding));
+
+        //~ // allocate memory for the binding - free this memory when done
+        //~ for (i = 0; i < numCols; i++)
+        //~ {
+            //~ catalogResult[i].TargetType = SQL_C_CHAR;
+            //~ catalogResult[i].BufferLength = (1024 + 1);
+            //~ catalogResult[i].TargetValuePtr = malloc(sizeof(unsigned char) * catalogResult[i].BufferLength);
+        //~ }
+
+        //~ // setup the binding (can be used even if the statement is closed by closeStatementHandle)
+        //~ for (i = 0 ; i < numCols ; i++)
+            //~ rv = SQLBindCol(sth, (SQLUSMALLINT) i + 1, catalogResult[i].TargetType, catalogResult[i].TargetValuePtr, catalogResult[i].BufferLength, &(catalogResult[i].StrLen_or_Ind));
+
+// output header row
+//~ for (i = 1; i <= col_count; i++)
+//~ {
+//~ buffer = (unsigned char *) url_encode((char *) col_data[i].col_name, strlen((char *) col_data[i].col_name), 0, NULL);
+//~ fputs((char *) buffer, stream);
+//~ free(buffer);
+//~ if (i < col_count)
+    //~ fputs(field_sep, stream);  encode_out(stdout, field_sep, 1);
+
+//~ }
+
+//~ fputs(rec_sep, stream); encode_out(stdout, rec_sep, 1);
+
+//~ fputs("RESULT=\"", stdout);
+//~ while ((i = fread(buffer, 1, 1024, stream)))
+//~ encode_out(stdout, buffer, i);
+//~ fputs("\";", stdout);
+
+//~ for (;;)
+//~ {
+//~ rv = SQLFetch(sth);
+
+//~ if (IS_SQL_SUCCESS(rv))
+//~ {
+    //~ for (i = 1; i <= col_count; i++)
+    //~ {
+        //~ for (;;)
+        //~ {
+            //~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
+
+            //~ if (IS_SQL_SUCCESS(rv) && copy_len != SQL_NULL_DATA && copy_len != 0)
+            //~ {
+                //~ copy_len = ((SQLUINTEGER) copy_len > buffer_size) || (copy_len == SQL_NO_TOTAL) ? (SQLINTEGER) buffer_size : copy_len;
+                //~ *total_len += encode_out(stream, buffer, copy_len);
+                //~ MD5Update(&md5_state, buffer, copy_len);
+
+                //~ if (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &status_size) != SQL_NO_DATA)
+                    //~ continue;
+            //~ }
+
+            //~ break;
+        //~ }
 
 //~ do {
-    //~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
+//~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
 //~ } while (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &statuslen) != SQL_NO_DATA);
 
-                if (i < col_count)
-                    fputs(field_sep, stream);
-            }
+        //~ if (i < col_count)
+            //~ fputs(field_sep, stream);
+    //~ }
+
+    //~ fputs(rec_sep, stream);
+//~ }
+//~ else
+    //~ break;
+//~ }
+
+        // all catalogs query
+        //~ printf("table\n");
+        //~ rv = SQLTables(sth, (SQLCHAR *) SQL_ALL_CATALOGS, SQL_NTS, (SQLCHAR *) "", SQL_NTS, (SQLCHAR *) "", SQL_NTS, (SQLCHAR *) "", SQL_NTS);
+        //~ for (rv = SQLFetch(sth); IS_SQL_SUCCESS(rv); rv = SQLFetch(sth))
+            //~ if (catalogResult[0].StrLen_or_Ind != SQL_NULL_DATA)
+                //~ printf("%s\n", (char *) catalogResult[0].TargetValuePtr);
+
+        //~ for (i = 0; i < numCols; i++)
+            //~ free(catalogResult[i].TargetValuePtr);
+        //~ free(catalogResult);
+    }
+    else
+    {
+        // select/insert/update/delete
+        start = timer_start(request);
+
+        if (cached)
+        {
+            if (!stmt_execute(conn, sql, params, param_count, &sth, request, out))
+                goto CLEANUP;
+        }
+        else if (!stmt_direct(conn, sql, params, param_count, &sth, request, out))
+            goto CLEANUP;
+
+        request->times.execute = timer_stop(request, start);
+
+        // anything but a SELECT may have changed what cached results would return, once it's
+        // done, so a SELECT that ran before it can't cache what it read afterwards
+        if (results.limit && sql_type != 's')
+            result_invalidate(sql);
+
+        rv = SQLNumResultCols(sth, &col_count);
+        if (error(out, "SQLNumResultCols", rv, SQL_HANDLE_STMT, sth) || col_count < 0)
+            goto CLEANUP;
+
+        rv = SQLRowCount(sth, &row_count);
+        if (error(out, "SQLRowCount", rv, SQL_HANDLE_STMT, sth))
+            goto CLEANUP;
 
-            fputs(rec_sep, stream);
+        if ((sql_type == 'i' || sql_type == 'u' || sql_type == 'd') && row_count > -1)
+        {
+            // insert/update/delete
+            // ODBC specifies SQLRowCount() only returns a value on INSERT/UPDATE/DELETE
+            // but MariaDB ODBC connector doesn't adhere to the spec, hence the special case code
+            // they thought they were clever. they were, but they were wrong
+            // only return ROWCOUNT according to the ODBC spec
+            buf_printf(out, "ROWCOUNT=%d", (int) row_count);
+            request->times.rows = row_count;
+        }
+        else if (col_count < 1)
+        {
+            // select without results
+            buf_puts(out, "RESULT=\"\"");
         }
         else
-            break;
+        {
+            // select with results
+            sent = send_rows(sth, col_count, key, request, out);
+
+            // the error has been sent instead
+            if (request->stopped)
+                goto CLEANUP;
+
+            // FETCH=n stopped short of the end, the statement becomes the cursor
+            if (request->more)
+            {
+                if (param_count)
+                    SQLFreeStmt(sth, SQL_RESET_PARAMS);
+
+                buf_printf(out, ",CURSOR=%lu", cursor_open(sth, conn->dbh));
+                sth = SQL_NULL_HSTMT;
+                reserved = 0;
+            }
+        }
+
+        end_response(out, request);
     }
 
-    fflush(stream);
-    free(col_data);
-    free(buffer);
-    MD5Final(md5_raw, &md5_state);
-// xxx do i need to free(md5_state)?
+    ok = 1;
+
+    CLEANUP:
+    conn_run(conn, NULL, SQL_NULL_HSTMT);
+
+    // a cancelled or timed out request gets its error, the daemon and the connection carry on
+    if (request->stopped)
+        ok = 1;
+
+    // so does a request that lost the connection, the next one gets a new connection first
+    if (!ok && (conn->lost || conn_lost(conn, sth)))
+    {
+        conn->lost = 1;
+
+        // unless it was in a group, whose writes went with the connection, see above
+        ok = !conn->group.count;
+    }
+
+    // a cached statement is only closed, it stays prepared for the next time
+    if (sth && cached)
+    {
+        SQLFreeStmt(sth, SQL_CLOSE);
+
+        if (param_count)
+            SQLFreeStmt(sth, SQL_RESET_PARAMS);
+    }
+    else if (sth)
+        SQLFreeHandle(SQL_HANDLE_STMT, sth);
+
+    if (reserved)
+        cursor_release();
+
+    free(params);
+    free(key);
+
+    stats_request(sql_type, clock_usec() - began, sent, request,
+                  conn->cache.hits - stmt_hits, conn->cache.misses - stmt_misses);
+
+    return ok;
+}
+
+// the ID leads every response so replies can be matched when workers finish out of order
+void start_response(s_buffer *out, s_request *request)
+{
+    char *encoded;
 
-    url_encode((char *) md5_raw, 16, 1, md5);
+    if (request->id[0])
+    {
+        encoded = url_encode(request->id, strlen(request->id), 0, NULL);
+        buf_printf(out, "ID=\"%s\",", encoded);
+        free(encoded);
+    }
 }
 
-#define tID     1
-#define tMD5    2
-#define tZIP    3
-#define tSQL    4
+/*
+ * Fetch the rows of sth and write them to out as the RESULT (or the STREAM=1 frames),
+ * storing them in the result cache under key when it's set.
+ * Returns what send_result() does.
+ */
+int send_rows(SQLHSTMT sth, SQLSMALLINT col_count, char *key, s_request *request, s_buffer *out)
+{
+    s_buffer      result;
+    unsigned long length;
+    char          md5[33];
+    int           zip = request->zip;
+    long long     start;
+
+    // a result going into the result cache is fetched uncompressed and compressed after
+    if (key)
+        request->zip = 0;
 
-int get_request(s_request *request)
+    buf_init(&result);
+    result.ztime = (request->timing ? &request->times.compress : NULL);
+
+    // frames go out from sql_fetch() as the result grows, compressed as one stream
+    // (with CODEC=auto once the first frame is there to sample, see stream_chunk())
+    if (request->stream)
+    {
+        request->stream_out = out;
+
+        if (request->codec != CODEC_AUTO)
+            zip_start(&result, request, ZIP_PROBE);
+    }
+
+    start = timer_start(request);
+    sql_fetch(sth, col_count, &result, md5, &length, request); // xxx length is total char length of returned data
+
+    // hashing, compressing and sending chunks done from sql_fetch() are reported on their own
+    request->times.fetch = timer_stop(request, start) - request->times.hash - request->times.compress - request->times.emit;
+
+    // the rows fetched before it was stopped are dropped, not sent or cached as if they were all of them
+    if (request->stopped)
+    {
+        request->zip = zip;
+        request->stream_out = NULL;
+        buf_free(&result);
+        error(out, stop_names[request->stopped], SQL_ERROR, SQL_HANDLE_STMT, sth);
+        return -1;
+    }
+
+    if (key)
+    {
+        request->zip = zip;
+        result_put(key, &result, md5, length, request->times.rows, request->generation);
+    }
+
+    if (!request->stream)
+        return send_result(out, &result, md5, length, request);
+
+    // the trailer frame
+    stream_chunk(out, &result, request, 1);
+    buf_printf(out, "%s=%s,ROWS=%lu", (request->hash == HASH_XXH64 ? "HASH" : "MD5"), md5, request->times.rows);
+    buf_free(&result);
+    request->stream_out = NULL;
+
+    return 1;
+}
+
+/*
+ * The MD5 (or HASH) and RESULT (or DELTA) part of a response for a fetched result, frees result.
+ * Returns 1 if the result was sent in full, 2 as a DELTA, 0 for RESULT=CACHED.
+ */
+int send_result(s_buffer *out, s_buffer *result, char *md5, unsigned long length, s_request *request)
+{
+    long long start;
+    int sent = 1;
+
+    buf_printf(out, "%s=%s,", (request->hash == HASH_XXH64 ? "HASH" : "MD5"), md5);
+
+    if (request->md5[0] && strcmp(md5, request->md5) == 0)
+    {
+        buf_puts(out, "RESULT=CACHED");
+        sent = 0;
+    }
+    else
+    {
+        // row hashes and working out the delta count as hashing
+        if (request->delta && snapshots.limit && request->format == FORMAT_TEXT && !result->z)
+        {
+            start = timer_start(request);
+            sent = delta_result(result, md5, request);
+            request->times.hash += timer_stop(request, start);
+        }
+
+        // unless sql_fetch() already started compressing, decide now that the length is known
+        if (!result->z)
+            zip_start(result, request, (sent == 2 ? result->length : length));
+
+        if (request->zip)
+        {
+            send_zip(out, request);
+            oddie_deflate_end(result);
+        }
+
+        start = timer_start(request);
+        send_data(out, (sent == 2 ? "DELTA" : "RESULT"), result, request);
+        request->times.emit = timer_stop(request, start);
+    }
+
+    request->times.bytes = result->written;
+    request->times.zbytes = result->length;
+
+    buf_free(result);
+
+    return sent;
+}
+
+/*
+ * Response to STATS=1: requests and a latency histogram per statement type, how many SELECT
+ * results went out in full, as CACHED or as a DELTA, their size before and after compression, the
+ * statement and result cache hits and misses, and errors by source, eg
+ * STATS="requests.select=10,...,latency.select=512:2 1024:8,...,errors.SQLExecDirect=1";
+ * A histogram lists the non-empty buckets as upper_bound_in_microseconds:count.
+ */
+void send_stats(s_buffer *out, s_request *request)
+{
+    int i, b, first;
+
+    start_response(out, request);
+
+    mutex_lock(&stats.lock);
+
+    buf_puts(out, "STATS=\"");
+
+    for (i = 0; i < STAT_TYPES; i++)
+        buf_printf(out, "requests.%s=%lu,", stat_types[i], stats.requests[i]);
+
+    buf_printf(out, "results.full=%lu,results.cached=%lu,results.delta=%lu,bytes=%.0f,zbytes=%.0f,stmt_cache.hits=%lu,stmt_cache.misses=%lu",
+               stats.full, stats.cached, stats.delta, (double) stats.bytes, (double) stats.zbytes, stats.stmt_hits, stats.stmt_misses);
+    buf_printf(out, ",reconnects=%lu,failovers=%lu,retries=%lu", stats.reconnects, stats.failovers, stats.retries);
+
+    for (i = 0; i < STAT_TYPES; i++)
+    {
+        buf_printf(out, ",latency.%s=", stat_types[i]);
+
+        for (b = 0, first = 1; b < STAT_BUCKETS; b++)
+        {
+            if (stats.latency[i][b])
+            {
+                buf_printf(out, "%s%lu:%lu", (first ? "" : " "), 1UL << b, stats.latency[i][b]);
+                first = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < STAT_SOURCES && stats.error_source[i]; i++)
+        buf_printf(out, ",errors.%s=%lu", stats.error_source[i], stats.errors[i]);
+
+    mutex_unlock(&stats.lock);
+
+    mutex_lock(&results.lock);
+    buf_printf(out, ",result_cache.hits=%lu,result_cache.misses=%lu", results.hits, results.misses);
+    mutex_unlock(&results.lock);
+
+    buf_puts(out, "\";");
+    buf_flush(out);
+}
+
+// count a finished request, sent is 1 for a full SELECT result, 2 for a DELTA, 0 for CACHED and -1 for anything else
+void stats_request(char sql_type, long long usec, int sent, s_request *request, unsigned long stmt_hits, unsigned long stmt_misses)
+{
+    int type = (sql_type == 's' ? 0 : sql_type == 'i' ? 1 : sql_type == 'u' ? 2 : sql_type == 'd' ? 3 : 4);
+    int b;
+
+    for (b = 0; b < STAT_BUCKETS - 1 && usec >= (1LL << b); b++)
+        ;
+
+    mutex_lock(&stats.lock);
+
+    stats.requests[type]++;
+    stats.latency[type][b]++;
+    stats.stmt_hits += stmt_hits;
+    stats.stmt_misses += stmt_misses;
+
+    if (sent >= 1)
+    {
+        if (sent == 2)
+            stats.delta++;
+        else
+            stats.full++;
+
+        stats.bytes += request->times.bytes;
+        stats.zbytes += request->times.zbytes;
+    }
+    else if (sent == 0)
+        stats.cached++;
+
+    mutex_unlock(&stats.lock);
+}
+
+void stats_error(const char *source)
+{
+    int i;
+
+    mutex_lock(&stats.lock);
+
+    for (i = 0; i < STAT_SOURCES; i++)
+    {
+        if (!stats.error_source[i])
+            stats.error_source[i] = source;
+
+        if (strcmp(stats.error_source[i], source) == 0)
+        {
+            stats.errors[i]++;
+            break;
+        }
+    }
+
+    mutex_unlock(&stats.lock);
+}
+
+/*
+ * STREAM=1: send what has been fetched into stream so far as a CHUNK frame and start the next
+ * frame in out. Compressed chunks are cut with a sync flush, so the client can inflate the
+ * concatenated chunks as they arrive. The last call finishes the deflate stream and only
+ * sends a chunk if there is something left to send.
+ */
+void stream_chunk(s_buffer *out, s_buffer *stream, s_request *request, int last)
+{
+    int zipped;
+    long long start;
+
+    // with CODEC=auto the first frame is the sample the codec is picked from
+    if (request->zip && !stream->z && request->codec == CODEC_AUTO)
+        zip_start(stream, request, stream->written);
+
+    zipped = (stream->z != NULL);
+
+    if (last && !stream->written && !zipped)
+        return;
+
+    if (zipped && last)
+        oddie_deflate_end(stream);
+    else if (zipped)
+        oddie_deflate_write(stream, NULL, 0, Z_SYNC_FLUSH);
+
+    request->times.bytes += stream->written;
+    request->times.zbytes += stream->length;
+
+    if (zipped)
+        send_zip(out, request);
+
+    start = timer_start(request);
+    send_data(out, "CHUNK", stream, request);
+    request->times.emit += timer_stop(request, start);
+
+    buf_puts(out, ";");
+
+    buf_clear(stream);
+    send_frame(out, request);
+    start_response(out, request);
+}
+
+/*
+ * The field name with data as its value, percent-encoded between quotes: NAME="...". A
+ * FORMAT=columnar result is binary, it goes as it is after its length instead: NAME=length:...
+ */
+void send_data(s_buffer *out, const char *name, s_buffer *data, s_request *request)
+{
+    unsigned char buffer[BUF_CHUNK];
+    unsigned long i;
+
+    buf_rewind(data);
+
+    if (request->format == FORMAT_COLUMNAR)
+    {
+        buf_printf(out, "%s=%lu:", name, data->length);
+
+        while ((i = buf_read(data, buffer, sizeof(buffer))))
+            buf_store(out, buffer, i);
+
+        return;
+    }
+
+    buf_printf(out, "%s=\"", name);
+
+    while ((i = buf_read(data, buffer, 1024)))
+        encode_buf(out, buffer, i, 0);
+
+    buf_puts(out, "\"");
+}
+
+// send the frame in out to the client now, for responses that take more than one frame
+void send_frame(s_buffer *out, s_request *request)
+{
+    if (out->direct)
+    {
+        fflush(out->file);
+        return;
+    }
+
+    // a --listen client gets it on its socket, outside the --ordered turns of stdout
+    if (request->client)
+    {
+        client_frame(out, request);
+        buf_clear(out);
+        return;
+    }
+
+    // a worker's response buffer, written out whole like the final frame will be
+    // (unless a failed request ended the daemon meanwhile)
+    if (output_lock(request))
+    {
+        buf_output(out, stdout);
+        mutex_unlock(&pool.output);
+    }
+
+    buf_clear(out);
+}
+
+// terminate a successful response, with the TIMING field first if the request asked for it
+void end_response(s_buffer *out, s_request *request)
+{
+    s_timing *t = &request->times;
+
+    // printed as doubles, %lld isn't in every C runtime we build against
+    if (request->timing)
+        buf_printf(out, ",TIMING=\"parse=%.0f,execute=%.0f,fetch=%.0f,hash=%.0f,compress=%.0f,emit=%.0f,rows=%lu,bytes=%lu,zbytes=%lu\"",
+                   (double) t->parse, (double) t->execute, (double) t->fetch, (double) t->hash,
+                   (double) t->compress, (double) t->emit, t->rows, t->bytes, t->zbytes);
+
+    buf_puts(out, ";");
+    buf_flush(out);
+}
+
+// monotonic clock in microseconds
+long long clock_usec(void)
+{
+#if defined(WIN32)
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return (count.QuadPart / freq.QuadPart) * 1000000 + (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// cond_wait() for no more than usec microseconds
+void cond_wait_usec(cond_t *c, mutex_t *m, long long usec)
+{
+#if defined(WIN32)
+    SleepConditionVariableCS(c, m, (DWORD) ((usec + 999) / 1000));
+#else
+    struct timespec ts;
+
+    // pthread_cond_timedwait() takes a CLOCK_REALTIME time
+    clock_gettime(CLOCK_REALTIME, &ts);
+    usec += ts.tv_nsec / 1000;
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec = (long) (usec % 1000000) * 1000;
+    pthread_cond_timedwait(c, m, &ts);
+#endif
+}
+
+// result cache key: the statement as sent, the hash type and the parameters as sent
+char *result_key(const char *sql, s_request *request)
+{
+    char *key;
+    const char *params = (request->params ? request->params : "");
+    unsigned long len = strlen(sql);
+
+    key = (char *) malloc(len + strlen(params) + 4);
+    memcpy(key, sql, len);
+    key[len] = '\n';
+    key[len + 1] = '0' + request->hash;
+    key[len + 2] = '0' + request->format;
+    strcpy(key + len + 3, params);
+
+    return key;
+}
+
+/*
+ * Copy the cached result for key into result, if there is one stored less than ttl seconds ago.
+ * Returns 0 on a miss, with *generation set for the result_put() of the result run instead.
+ */
+int result_get(const char *key, int ttl, s_buffer *result, char *md5, unsigned long *length, unsigned long *rows, unsigned long *generation)
+{
+    s_result *entry;
+    unsigned long hash = hash_string(key);
+    time_t now = time(NULL);
+    int found = 0;
+
+    mutex_lock(&results.lock);
+
+    for (entry = results.head; entry; entry = entry->next)
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            break;
+
+    if (entry && now - entry->stored < ttl)
+    {
+        // move to the front
+        if (entry->prev)
+        {
+            entry->prev->next = entry->next;
+
+            if (entry->next)
+                entry->next->prev = entry->prev;
+            else
+                results.tail = entry->prev;
+
+            entry->prev = NULL;
+            entry->next = results.head;
+            results.head->prev = entry;
+            results.head = entry;
+        }
+
+        buf_init(result);
+        buf_write(result, entry->data, entry->size);
+        strcpy(md5, entry->md5);
+        *length = entry->length;
+        *rows = entry->rows;
+        results.hits++;
+        found = 1;
+    }
+    else
+    {
+        *generation = results.generation;
+        results.misses++;
+    }
+
+    mutex_unlock(&results.lock);
+
+    return found;
+}
+
+/*
+ * Store a copy of result under key, dropping least recently used results to stay within the limit.
+ * A result read before generation ended, ie before a write that may have changed it finished,
+ * isn't stored.
+ */
+void result_put(char *key, s_buffer *result, char *md5, unsigned long length, unsigned long rows, unsigned long generation)
+{
+    s_result *entry, *old;
+    unsigned long size = result->length + strlen(key) + sizeof(s_result);
+
+    if (size > results.limit)
+        return;
+
+    entry = (s_result *) calloc(1, sizeof(s_result));
+    entry->key = strdup(key);
+    entry->hash = hash_string(key);
+    entry->stored = time(NULL);
+    strcpy(entry->md5, md5);
+    entry->length = length;
+    entry->rows = rows;
+    entry->data = (unsigned char *) malloc(result->length ? result->length : 1);
+
+    buf_rewind(result);
+    entry->size = buf_read(result, entry->data, result->length);
+
+    mutex_lock(&results.lock);
+
+    if (generation != results.generation)
+    {
+        mutex_unlock(&results.lock);
+        free(entry->key);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+
+    // replaces an older copy of the same result
+    for (old = results.head; old; old = old->next)
+    {
+        if (old->hash == entry->hash && strcmp(old->key, key) == 0)
+        {
+            result_remove(old);
+            break;
+        }
+    }
+
+    while (results.tail && results.size + size > results.limit)
+        result_remove(results.tail);
+
+    entry->next = results.head;
+
+    if (results.head)
+        results.head->prev = entry;
+    else
+        results.tail = entry;
+
+    results.head = entry;
+    results.size += size;
+
+    mutex_unlock(&results.lock);
+}
+
+// unlink and free a cached result, called with the lock held
+void result_remove(s_result *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        results.head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        results.tail = entry->prev;
+
+    results.size -= entry->size + strlen(entry->key) + sizeof(s_result);
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+/*
+ * Drop the cached results a statement may change: for INSERT, UPDATE and DELETE those that
+ * mention its table anywhere, for anything else all of them, and keep SELECTs still running from
+ * caching what they read. Called once the statement has run. Changes made outside oddie are
+ * only picked up when the results expire.
+ */
+void result_invalidate(const char *sql)
+{
+    s_result *entry, *next;
+    char table[256];
+    int all = !sql_table(sql, table, sizeof(table));
+
+    mutex_lock(&results.lock);
+    results.generation++;
+
+    for (entry = results.head; entry; entry = next)
+    {
+        next = entry->next;
+
+        if (all || sql_mentions(entry->key, table))
+            result_remove(entry);
+    }
+
+    mutex_unlock(&results.lock);
+}
+
+/*
+ * DELTA=1: when the client's MD5 is that of a result whose row hashes are still kept, turn
+ * result into the DELTA body that makes the new result out of the old one, if it's smaller.
+ * Either way the row hashes of result are kept under md5 for the next request.
+ * Returns 2 if result now holds the delta, 1 if it still holds the full result.
+ */
+int delta_result(s_buffer *result, char *md5, s_request *request)
+{
+    s_buffer delta;
+    s_edit *edits;
+    uint64 *hashes, *old = NULL;
+    unsigned long rows, old_rows = 0;
+    long count;
+    int sent = 1;
+
+    hashes = delta_hashes(result, &rows);
+
+    if (request->md5[0])
+        old = snapshot_get(request->md5, &old_rows);
+
+    // rows are matched below the header, a different header is a different result
+    if (old && rows && old_rows && old[0] == hashes[0]
+        && (edits = delta_diff(old + 1, old_rows - 1, hashes + 1, rows - 1, &count)))
+    {
+        buf_init(&delta);
+        delta.spill = result->spill;
+
+        if (delta_write(result, edits, count, &delta))
+        {
+            buf_free(result);
+            *result = delta;
+            sent = 2;
+        }
+        else
+            buf_free(&delta);
+
+        free(edits);
+    }
+
+    free(old);
+    snapshot_put(md5, hashes, rows);
+
+    return sent;
+}
+
+// the next piece of the current row of the result r reads; *end is set when the row ends there,
+// 0 without *end at the end of the result
+unsigned long row_read(s_row_reader *r, unsigned char **data, int *end)
+{
+    unsigned char *nl;
+    unsigned long n;
+
+    *end = 0;
+
+    if (r->pos == r->len)
+    {
+        r->pos = 0;
+
+        if (!(r->len = buf_read(r->b, r->buf, BUF_CHUNK)))
+            return 0;
+    }
+
+    *data = r->buf + r->pos;
+    nl = (unsigned char *) memchr(*data, rec_sep[0], r->len - r->pos);
+    n = (nl ? (unsigned long) (nl - *data) : r->len - r->pos);
+    r->pos += n + (nl != NULL);
+    *end = (nl != NULL);
+
+    return n;
+}
+
+// XXH64 of each row of an uncompressed text result, header included
+uint64 *delta_hashes(s_buffer *result, unsigned long *rows)
+{
+    s_row_reader *r = (s_row_reader *) calloc(1, sizeof(s_row_reader));
+    unsigned long size = 1024, n;
+    uint64 *hashes = (uint64 *) malloc(size * sizeof(uint64));
+    unsigned char *data, digest[8];
+    XXH64Context ctx;
+    int end;
+
+    *rows = 0;
+    r->b = result;
+    buf_rewind(result);
+    XXH64Init(&ctx, 0);
+
+    while ((n = row_read(r, &data, &end)) || end)
+    {
+        XXH64Update(&ctx, data, n);
+
+        if (end)
+        {
+            if (*rows == size)
+                hashes = (uint64 *) realloc(hashes, (size *= 2) * sizeof(uint64));
+
+            XXH64Final(digest, &ctx);
+            memcpy(&hashes[(*rows)++], digest, 8);
+            XXH64Init(&ctx, 0);
+        }
+    }
+
+    free(r);
+
+    return hashes;
+}
+
+/*
+ * The shortest edit script turning the rows a into the rows b, matched by their hashes
+ * (Myers' O(ND) diff, after the rows both start and end with are taken off). Edits are
+ * in order, a '-' drops a[old_row], a '+' puts b[new_row] in before a[old_row].
+ * NULL if it takes more than DELTA_EDITS of them, the full result is better then.
+ */
+s_edit *delta_diff(const uint64 *a, long n, const uint64 *b, long m, long *count)
+{
+    long pre = 0, post = 0, max, d, k, x, y, prev_k, size = 0;
+    long *v, *trace = NULL, *vd;
+    s_edit *edits = NULL;
+
+    while (pre < n && pre < m && a[pre] == b[pre])
+        pre++;
+
+    while (post < n - pre && post < m - pre && a[n - 1 - post] == b[m - 1 - post])
+        post++;
+
+    a += pre;
+    b += pre;
+    n -= pre + post;
+    m -= pre + post;
+    max = (n + m < DELTA_EDITS ? n + m : DELTA_EDITS);
+
+    // v[k] is the furthest x on diagonal k = x - y, trace keeps v as it was before each d
+    v = (long *) calloc(2 * max + 3, sizeof(long));
+    v += max + 1;
+
+    for (d = 0; d <= max; d++)
+    {
+        if ((d + 1) * (d + 1) > size)
+            trace = (long *) realloc(trace, (size = 2 * (d + 1) * (d + 1)) * sizeof(long));
+
+        memcpy(trace + d * d, v - d, (2 * d + 1) * sizeof(long));
+
+        for (k = -d; k <= d; k += 2)
+        {
+            x = (k == -d || (k != d && v[k - 1] < v[k + 1]) ? v[k + 1] : v[k - 1] + 1);
+            y = x - k;
+
+            while (x < n && y < m && a[x] == b[y])
+                x++, y++;
+
+            v[k] = x;
+
+            if (x >= n && y >= m)
+                goto FOUND;
+        }
+    }
+
+    goto CLEANUP;
+
+    FOUND:
+    // back from the end, one edit per d
+    *count = d;
+    edits = (s_edit *) malloc((d + 1) * sizeof(s_edit));
+    x = n;
+    y = m;
+
+    for (; d > 0; d--)
+    {
+        vd = trace + d * d + d;
+        k = x - y;
+        prev_k = (k == -d || (k != d && vd[k - 1] < vd[k + 1]) ? k + 1 : k - 1);
+        x = vd[prev_k];
+        y = x - prev_k;
+
+        edits[d - 1].op = (prev_k == k + 1 ? '+' : '-');
+        edits[d - 1].old_row = x + pre;
+        edits[d - 1].new_row = y + pre;
+    }
+
+    CLEANUP:
+    free(v - max - 1);
+    free(trace);
+
+    return edits;
+}
+
+/*
+ * Write the DELTA body for the edits into delta, a line per edit, "-i" for old row i dropped
+ * and "+i\t" then the row for a new row put in before old row i (rows counted from 0 after
+ * the header). Returns 0 as soon as it gets as long as result itself.
+ */
+int delta_write(s_buffer *result, s_edit *edits, long count, s_buffer *delta)
+{
+    s_row_reader *r = (s_row_reader *) calloc(1, sizeof(s_row_reader));
+    unsigned char *data;
+    unsigned long n;
+    long i, row = -1;  // the header is row -1
+    int end = 0, ok = 1;
+
+    r->b = result;
+    buf_rewind(result);
+
+    for (i = 0; i < count && ok; i++)
+    {
+        if (edits[i].op == '-')
+        {
+            buf_printf(delta, "-%ld%s", edits[i].old_row, rec_sep);
+            continue;
+        }
+
+        // skip to the new row, through the end of the one before it
+        for (; row < edits[i].new_row; row++)
+            while (row_read(r, &data, &end) && !end)
+                ;
+
+        buf_printf(delta, "+%ld%s", edits[i].old_row, field_sep);
+
+        do
+        {
+            n = row_read(r, &data, &end);
+            buf_write(delta, data, n);
+        }
+        while (n && !end);
+
+        buf_puts(delta, rec_sep);
+        row++;
+
+        ok = (delta->length < result->length);
+    }
+
+    free(r);
+
+    return ok && delta->length < result->length;
+}
+
+// a copy of the row hashes kept under md5, NULL if they aren't
+uint64 *snapshot_get(const char *md5, unsigned long *rows)
+{
+    s_snapshot *entry;
+    uint64 *hashes = NULL;
+
+    mutex_lock(&snapshots.lock);
+
+    for (entry = snapshots.head; entry; entry = entry->next)
+        if (strcmp(entry->md5, md5) == 0)
+            break;
+
+    if (entry)
+    {
+        // move to the front
+        if (entry->prev)
+        {
+            entry->prev->next = entry->next;
+
+            if (entry->next)
+                entry->next->prev = entry->prev;
+            else
+                snapshots.tail = entry->prev;
+
+            entry->prev = NULL;
+            entry->next = snapshots.head;
+            snapshots.head->prev = entry;
+            snapshots.head = entry;
+        }
+
+        hashes = (uint64 *) malloc((entry->rows + 1) * sizeof(uint64));
+        memcpy(hashes, entry->hashes, entry->rows * sizeof(uint64));
+        *rows = entry->rows;
+    }
+
+    mutex_unlock(&snapshots.lock);
+
+    return hashes;
+}
+
+// keep the row hashes of a result sent with md5, dropping the least recently used ones to make room; takes hashes
+void snapshot_put(const char *md5, uint64 *hashes, unsigned long rows)
+{
+    s_snapshot *entry, *old;
+    unsigned long size = rows * sizeof(uint64) + sizeof(s_snapshot);
+
+    if (size > snapshots.limit)
+    {
+        free(hashes);
+        return;
+    }
+
+    entry = (s_snapshot *) calloc(1, sizeof(s_snapshot));
+    strcpy(entry->md5, md5);
+    entry->rows = rows;
+    entry->hashes = hashes;
+
+    mutex_lock(&snapshots.lock);
+
+    // the same result again, eg from another client polling it
+    for (old = snapshots.head; old; old = old->next)
+    {
+        if (strcmp(old->md5, md5) == 0)
+        {
+            snapshot_remove(old);
+            break;
+        }
+    }
+
+    while (snapshots.tail && snapshots.size + size > snapshots.limit)
+        snapshot_remove(snapshots.tail);
+
+    entry->next = snapshots.head;
+
+    if (snapshots.head)
+        snapshots.head->prev = entry;
+    else
+        snapshots.tail = entry;
+
+    snapshots.head = entry;
+    snapshots.size += size;
+
+    mutex_unlock(&snapshots.lock);
+}
+
+// unlink and free kept row hashes, called with the lock held
+void snapshot_remove(s_snapshot *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        snapshots.head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        snapshots.tail = entry->prev;
+
+    snapshots.size -= entry->rows * sizeof(uint64) + sizeof(s_snapshot);
+    free(entry->hashes);
+    free(entry);
+}
+
+// take a slot for a new cursor, dropping idle ones that expired first, 0 if all are in use
+int cursor_reserve(void)
+{
+    int ok;
+
+    mutex_lock(&cursors.lock);
+    cursor_expire(time(NULL));
+
+    if ((ok = (cursors.count < cursors.limit)))
+        cursors.count++;
+
+    mutex_unlock(&cursors.lock);
+
+    return ok;
+}
+
+/*
+ * Close the idle cursors that expired, so their statements don't stay open on the server until
+ * another cursor is wanted. Done for every request, and with --listen by the poll loop.
+ */
+void cursor_sweep(void)
+{
+    mutex_lock(&cursors.lock);
+    cursor_expire(time(NULL));
+    mutex_unlock(&cursors.lock);
+}
+
+// close the cursors idle for ttl seconds by now, with cursors.lock held
+void cursor_expire(time_t now)
+{
+    s_cursor **link;
+
+    for (link = &cursors.head; *link; )
+    {
+        if (!(*link)->busy && now - (*link)->used >= cursors.ttl)
+            cursor_remove(link);
+        else
+            link = &(*link)->next;
+    }
+}
+
+// give back a slot from cursor_reserve() that wasn't needed after all
+void cursor_release(void)
+{
+    mutex_lock(&cursors.lock);
+    cursors.count--;
+    mutex_unlock(&cursors.lock);
+}
+
+// keep sth open as a new cursor in a slot from cursor_reserve(), returns its id
+unsigned long cursor_open(SQLHSTMT sth, SQLHDBC dbh)
+{
+    s_cursor *cursor = (s_cursor *) calloc(1, sizeof(s_cursor));
+
+    cursor->sth = sth;
+    cursor->dbh = dbh;
+    cursor->used = time(NULL);
+
+    mutex_lock(&cursors.lock);
+    cursor->id = ++cursors.last_id;
+    cursor->next = cursors.head;
+    cursors.head = cursor;
+    mutex_unlock(&cursors.lock);
+
+    return cursor->id;
+}
+
+/*
+ * The cursor with id, if it's open and hasn't been idle for longer than the ttl.
+ * It's marked busy until it goes back with cursor_put(), so no other request can
+ * fetch from it or expire it in the meantime. NULL if there is no such cursor.
+ */
+s_cursor *cursor_take(unsigned long id)
+{
+    s_cursor **link, *cursor = NULL;
+
+    mutex_lock(&cursors.lock);
+
+    for (link = &cursors.head; *link; link = &(*link)->next)
+    {
+        if ((*link)->id != id)
+            continue;
+
+        if ((*link)->busy)
+            break;
+
+        if (time(NULL) - (*link)->used >= cursors.ttl)
+        {
+            cursor_remove(link);
+            break;
+        }
+
+        cursor = *link;
+        cursor->busy = 1;
+        break;
+    }
+
+    mutex_unlock(&cursors.lock);
+
+    return cursor;
+}
+
+// hand back a cursor from cursor_take(), closing it unless keep is set
+void cursor_put(s_cursor *cursor, int keep)
+{
+    s_cursor **link;
+
+    mutex_lock(&cursors.lock);
+
+    cursor->busy = 0;
+    cursor->used = time(NULL);
+    cond_broadcast(&cursors.idle);
+
+    if (!keep)
+    {
+        for (link = &cursors.head; *link != cursor; link = &(*link)->next)
+            ;
+
+        cursor_remove(link);
+    }
+
+    mutex_unlock(&cursors.lock);
+}
+
+// close the cursor *link points to and unlink it, with cursors.lock held
+void cursor_remove(s_cursor **link)
+{
+    s_cursor *cursor = *link;
+
+    *link = cursor->next;
+    SQLFreeHandle(SQL_HANDLE_STMT, cursor->sth);
+    free(cursor);
+    cursors.count--;
+}
+
+// close the cursors open on a connection that's about to go, waiting for the ones being fetched from
+void cursor_drop(SQLHDBC dbh)
+{
+    s_cursor **link;
+
+    mutex_lock(&cursors.lock);
+
+    for (link = &cursors.head; *link; )
+    {
+        if ((*link)->dbh != dbh)
+            link = &(*link)->next;
+        else if ((*link)->busy)
+        {
+            cond_wait(&cursors.idle, &cursors.lock);
+            link = &cursors.head;
+        }
+        else
+            cursor_remove(link);
+    }
+
+    mutex_unlock(&cursors.lock);
+}
+
+/*
+ * Copy the table name of an INSERT INTO, UPDATE or DELETE FROM statement into table,
+ * without quotes or brackets and without any schema part.
+ * Returns 0 for any other statement, or if the name doesn't fit.
+ */
+int sql_table(const char *sql, char *table, int size)
+{
+    const char *keywords[] = {"insert", "into", "update", "delete", "from"};
+    const char *p = sql;
+    int i, n, len, words = 0;
+    char close;
+
+    for (;;)
+    {
+        while (isspace((unsigned char) *p))
+            p++;
+
+        for (i = 0; i < 5; i++)
+        {
+            n = strlen(keywords[i]);
+
+            if (strncasecmp(p, keywords[i], n) == 0 && !isalnum((unsigned char) p[n]) && p[n] != '_')
+                break;
+        }
+
+        if (i == 5)
+            break;
+
+        p += n;
+        words++;
+    }
+
+    if (!words)
+        return 0;
+
+    // the last part of a possibly quoted, possibly qualified name
+    for (len = 0;;)
+    {
+        close = (*p == '[' ? ']' : (*p == '"' || *p == '`' ? *p : 0));
+
+        if (close)
+            p++;
+
+        for (len = 0; *p && (close ? *p != close : (isalnum((unsigned char) *p) || *p == '_')); p++)
+        {
+            if (len + 1 >= size)
+                return 0;
+
+            table[len++] = *p;
+        }
+
+        if (close && *p)
+            p++;
+
+        if (*p != '.')
+            break;
+
+        p++;
+    }
+
+    table[len] = 0;
+
+    return len > 0;
+}
+
+// whether name appears in sql as a whole word, ignoring case
+int sql_mentions(const char *sql, const char *name)
+{
+    const char *p;
+    int n = strlen(name);
+
+    for (p = sql; *p; p++)
+    {
+        if (strncasecmp(p, name, n) == 0
+            && (p == sql || !(isalnum((unsigned char) p[-1]) || p[-1] == '_'))
+            && !(isalnum((unsigned char) p[n]) || p[n] == '_'))
+            return 1;
+    }
+
+    return 0;
+}
+
+// whether sql is a plain SELECT, that can be run again on a new connection: not SELECT INTO,
+// not a locking read (FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE) and without lock hints
+int sql_retry(const char *sql)
+{
+    const char *words[] = {"into", "update", "share", "updlock", "xlock", "holdlock", "tablockx"};
+    unsigned i;
+
+    if (strncasecmp(sql, "select", 6) != 0 || isalnum((unsigned char) sql[6]) || sql[6] == '_')
+        return 0;
+
+    for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+    {
+        if (sql_mentions(sql, words[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+THREAD_PROC(worker_main, arg)
+{
+    s_worker  *worker = (s_worker *) arg;
+    s_group   *group = &worker->conn->group;
+    s_request *request;
+    s_buffer  response;
+    int       ok;
+
+    for (;;)
+    {
+        // a group is committed once no more writes have turned up for it in time
+        // (a failed request closes and empties the queue, so the loop ends after it)
+        if (!(request = queue_pop(group->count ? group->started + group_window * 1000 : 0, worker->conn)))
+        {
+            if (!group->count)
+                break;
+
+            group_commit(worker->conn);
+            continue;
+        }
+
+        if (group_member(request))
+        {
+            group_run(worker->conn, request);
+            continue;
+        }
+
+        // anything else goes after the writes before it
+        if (!group_commit(worker->conn))
+        {
+            request_free(request);
+            continue;
+        }
+
+        buf_init(&response);
+
+        // with --ordered STATS=1 waits its turn like anything else
+        if (request->stats)
+        {
+            // it doesn't get to run_request(), which lets go of the others once they're done
+            conn_run(worker->conn, NULL, SQL_NULL_HSTMT);
+            send_stats(&response, request);
+            ok = 1;
+        }
+        else
+            ok = run_request(worker->conn, request, request->sql, &response);
+
+        output_response(&response, request, ok);
+        buf_free(&response);
+        request_free(request);
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a request, waiting for room when --read-ahead limits the queue.
+ * Returns 0 if the queue was closed instead, the request is freed then.
+ */
+int queue_push(s_request *request)
+{
+    mutex_lock(&pool.lock);
+
+    while (pool.limit && pool.count >= pool.limit && !pool.closed)
+        cond_wait(&pool.space, &pool.lock);
+
+    if (pool.closed)
+    {
+        mutex_unlock(&pool.lock);
+        request_free(request);
+        return 0;
+    }
+
+    request->seq = pool.next_seq++;
+
+    if (pool.tail)
+        pool.tail->next = request;
+    else
+        pool.head = request;
+
+    pool.tail = request;
+    pool.count++;
+    cond_signal(&pool.ready);
+    mutex_unlock(&pool.lock);
+
+    return 1;
+}
+
+/*
+ * Next queued request, NULL once the queue is closed and empty, or at deadline (clock_usec())
+ * when it's set. It's running on conn from then on (see conn_run()), so a CANCEL= can't miss it.
+ */
+s_request *queue_pop(long long deadline, s_conn *conn)
+{
+    s_request *request;
+    long long now;
+
+    mutex_lock(&pool.lock);
+
+    while (!pool.head && !pool.closed)
+    {
+        if (!deadline)
+            cond_wait(&pool.ready, &pool.lock);
+        else if ((now = clock_usec()) < deadline)
+            cond_wait_usec(&pool.ready, &pool.lock, deadline - now);
+        else
+            break;
+    }
+
+    if ((request = pool.head))
+    {
+        if (!(pool.head = request->next))
+            pool.tail = NULL;
+
+        request->next = NULL;
+        pool.count--;
+        cond_signal(&pool.space);
+    }
+
+    if (conn)
+    {
+        conn->request = request;
+        conn->active = SQL_NULL_HSTMT;
+    }
+
+    mutex_unlock(&pool.lock);
+
+    return request;
+}
+
+/*
+ * Take the lock on stdout for a worker's response, with --ordered once the ones before it are out.
+ * Returns 0 without it once a failed request has ended the daemon, nothing goes out after its response.
+ */
+int output_lock(s_request *request)
+{
+    mutex_lock(&pool.output);
+
+    while (pool.ordered && request->seq != pool.next_out && !pool.failed)
+        cond_wait(&pool.turn, &pool.output);
+
+    if (pool.failed)
+    {
+        mutex_unlock(&pool.output);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Let go of stdout after a worker's response, letting the next one out with --ordered. After
+ * a failed request's it ends the daemon instead, the way the serial loop does: the queue is
+ * closed and emptied, so the workers stop once they're done with what's running.
+ */
+void output_unlock(int ok)
+{
+    s_request *request;
+
+    if (ok)
+        pool.next_out++;
+    else
+        pool.failed = 1;
+
+    cond_broadcast(&pool.turn);
+    mutex_unlock(&pool.output);
+
+    if (ok)
+        return;
+
+    mutex_lock(&pool.lock);
+    pool.closed = 1;
+
+    while ((request = pool.head))
+    {
+        pool.head = request->next;
+        request_free(request);
+    }
+
+    pool.tail = NULL;
+    pool.count = 0;
+    cond_broadcast(&pool.ready);
+    cond_broadcast(&pool.space);
+    mutex_unlock(&pool.lock);
+}
+
+/*
+ * Send a worker's response, to its client or in its turn on stdout with --ordered.
+ * Returns 0 if it's that of a failed request that ends the daemon, one from a client only ends the client.
+ */
+int output_response(s_buffer *response, s_request *request, int ok)
+{
+    if (request->client)
+    {
+        client_send(response, request, ok);
+        return 1;
+    }
+
+    if (!output_lock(request))
+        return 0;
+
+    buf_output(response, stdout);
+    output_unlock(ok);
+
+    return ok;
+}
+
+/*
+ * Daemon mode: read and parse requests into the queue while the workers, or the serial loop,
+ * run the ones before them, up to --read-ahead of them. Stops at the end of the input, the
+ * first empty request (eg CLOSE=0;) or once a failed request has closed the queue, closing it.
+ */
+THREAD_PROC(reader_main, arg)
+{
+    s_request *queued;
+    s_buffer  response;
+
+    (void) arg;
+
+    for (;;)
+    {
+        queued = (s_request *) calloc(1, sizeof(s_request));
+
+        if (!get_request(queued) || (!queued->stats && !queued->cursor && !queued->sql[0] && !queued->cancel[0]))
+        {
+            request_free(queued);
+            break;
+        }
+
+        // the request it stops can be the one running right now
+        if (queued->cancel[0])
+        {
+            request_cancel(queued);
+            request_free(queued);
+            continue;
+        }
+
+        if (queued->stats && pool.stats_ahead)
+        {
+            // answered right away, ahead of anything still queued
+            buf_init(&response);
+            send_stats(&response, queued);
+
+            mutex_lock(&pool.output);
+
+            if (!pool.failed)
+                buf_output(&response, stdout);
+
+            mutex_unlock(&pool.output);
+
+            buf_free(&response);
+            request_free(queued);
+            continue;
+        }
+
+        if (!queue_push(queued))
+            break;
+    }
+
+    mutex_lock(&pool.lock);
+    pool.closed = 1;
+    pool.reading = 0;
+    cond_broadcast(&pool.ready);
+    mutex_unlock(&pool.lock);
+
+    return 0;
+}
+
+void request_free(s_request *request)
+{
+    free(request->sql);
+    free(request->params);
+    free(request->bulk_rows);
+    free(request);
+}
+
+/*
+ * CANCEL=id: stop the requests with that ID from the same client (or stdin). A queued one is
+ * answered with the error once a worker gets to it, a running one has its statement cancelled
+ * with SQLCancel() or stops at the next block of rows.
+ */
+void request_cancel(s_request *cancel)
+{
+    s_request *request;
+    s_conn *conn;
+    int n;
+
+    mutex_lock(&pool.lock);
+
+    for (request = pool.head; request; request = request->next)
+        if (request->client == cancel->client && strcmp(request->id, cancel->cancel) == 0)
+            request->stopped = STOP_CANCEL;
+
+    for (n = 0; n < pool.conn_count; n++)
+    {
+        conn = &pool.conns[n];
+
+        if (conn->request && conn->request->client == cancel->client && strcmp(conn->request->id, cancel->cancel) == 0)
+        {
+            conn->request->stopped = STOP_CANCEL;
+
+            if (conn->active)
+                SQLCancel(conn->active);
+        }
+    }
+
+    mutex_unlock(&pool.lock);
+}
+
+// whether request has been cancelled, or has run past its deadline, which then stops it
+int request_stopped(s_request *request)
+{
+    if (!request->stopped && request->deadline && clock_usec() >= request->deadline)
+        request->stopped = STOP_TIMEOUT;
+
+    return request->stopped;
+}
+
+// say which request is running on conn, and which of its statements the driver has, for request_cancel(); NULL for none
+void conn_run(s_conn *conn, s_request *request, SQLHSTMT sth)
+{
+    mutex_lock(&pool.lock);
+    conn->request = request;
+    conn->active = sth;
+    mutex_unlock(&pool.lock);
+}
+
+// whether a call that failed on sth (or on conn itself, without one) did because the connection is gone
+int conn_lost(s_conn *conn, SQLHSTMT sth)
+{
+    SQLCHAR     sql_state[6], msg[SQL_MAX_MESSAGE_LENGTH];
+    SQLINTEGER  error_id;
+    SQLSMALLINT msg_len;
+
+    // 08xxx are the connection exceptions, eg 08S01 communication link failure
+    if (sth && SQLGetDiagRec(SQL_HANDLE_STMT, sth, 1, sql_state, &error_id, msg, sizeof(msg), &msg_len) != SQL_NO_DATA
+        && strncmp((char *) sql_state, "08", 2) == 0)
+        return 1;
+
+    if (SQLGetDiagRec(SQL_HANDLE_DBC, conn->dbh, 1, sql_state, &error_id, msg, sizeof(msg), &msg_len) != SQL_NO_DATA
+        && strncmp((char *) sql_state, "08", 2) == 0)
+        return 1;
+
+    return conn_dead(conn->dbh);
+}
+
+// SQL_ATTR_CONNECTION_DEAD, what the driver already knows without a round trip; a driver without it never says so
+int conn_dead(SQLHDBC dbh)
+{
+    SQLUINTEGER dead = SQL_CD_FALSE;
+    RETCODE rv;
+
+    rv = SQLGetConnectAttr(dbh, SQL_ATTR_CONNECTION_DEAD, &dead, SQL_IS_UINTEGER, NULL);
+
+    return (IS_SQL_SUCCESS(rv) && dead == SQL_CD_TRUE);
+}
+
+// whether the driver can SQLGetData a row of a block fetch, bound columns too (SQL_GD_BLOCK and SQL_GD_BOUND), see sql_fetch_block()
+int conn_getdata(s_conn *conn)
+{
+    SQLUINTEGER ext = 0;
+
+    // asked once it answers, the connection may be gone the first time
+    if (!conn->getdata && IS_SQL_SUCCESS(SQLGetInfo(conn->dbh, SQL_GETDATA_EXTENSIONS, &ext, sizeof(ext), NULL)))
+        conn->getdata = 1 + ((ext & (SQL_GD_BLOCK | SQL_GD_BOUND)) == (SQL_GD_BLOCK | SQL_GD_BOUND));
+
+    return (conn->getdata == 2);
+}
+
+/*
+ * Replace the lost connection of conn, with the --standby one when it's ready, otherwise with
+ * a new one. The prepared statements and cursors of the old one go with it. Returns 0 if it
+ * couldn't be made, conn->lost is set then and the next request tries again.
+ */
+int conn_reconnect(s_conn *conn, s_buffer *out)
+{
+    SQLHDBC dbh;
+    int failover;
+
+    mutex_lock(&standby.lock);
+    dbh = standby.dbh;
+    standby.dbh = SQL_NULL_HDBC;
+    cond_signal(&standby.wake);
+    mutex_unlock(&standby.lock);
+
+    // whatever took this one down can have taken the standby too, eg a server restart
+    if (dbh && conn_dead(dbh))
+    {
+        cleanup(SQL_NULL_HENV, dbh, SQL_NULL_HSTMT);
+        dbh = SQL_NULL_HDBC;
+    }
+
+    failover = (dbh != SQL_NULL_HDBC);
+
+    if (!dbh && !(dbh = db_open(standby.henv, standby.dsn, out)))
+    {
+        conn->lost = 1;
+        return 0;
+    }
+
+    cursor_drop(conn->dbh);
+    db_close(conn);
+    conn->dbh = dbh;
+    conn->lost = 0;
+
+    mutex_lock(&stats.lock);
+    stats.reconnects++;
+    stats.failovers += failover;
+    mutex_unlock(&stats.lock);
+
+    return 1;
+}
+
+/*
+ * After rv from executing *sth: a SELECT that lost its connection gets a new one to run
+ * once more on, nothing of it has gone out yet. *sth is let go of first (a cached one goes
+ * with the statement cache). Returns 1 to run it again, -1 if the connection couldn't be
+ * made again (the error has been written to out), 0 to fail as usual.
+ */
+int conn_retry(s_conn *conn, SQLHSTMT *sth, int cached, RETCODE rv, s_request *request, s_buffer *out)
+{
+    if (IS_SQL_SUCCESS(rv) || rv == SQL_NO_DATA || !request->retry || request->stopped || !conn_lost(conn, *sth))
+        return 0;
+
+    request->retry = 0;
+    conn_run(conn, request, SQL_NULL_HSTMT);
+
+    if (!cached && *sth)
+        SQLFreeHandle(SQL_HANDLE_STMT, *sth);
+
+    *sth = SQL_NULL_HSTMT;
+
+    if (!conn_reconnect(conn, out))
+        return -1;
+
+    mutex_lock(&stats.lock);
+    stats.retries++;
+    mutex_unlock(&stats.lock);
+
+    return 1;
+}
+
+// with --group-commit, an INSERT, UPDATE or DELETE that can wait for the writes after it to be committed with them
+int group_member(s_request *request)
+{
+    char *sql = request->sql;
+
+    if (!group_size || request->stats || request->cursor || request->bulk)
+        return 0;
+
+    while (sql[0] && sql[0] < 33)
+        sql++;
+
+    return (strncasecmp(sql, "insert", 6) == 0 || strncasecmp(sql, "update", 6) == 0 || strncasecmp(sql, "delete", 6) == 0);
+}
+
+/*
+ * Run a write in the transaction of conn's group, started with autocommit turned off by the
+ * first of them, holding its response until the group is committed. The group is committed
+ * once it's --group-commit writes long, and run again a write at a time when one fails.
+ * Takes request. Returns 0 if the daemon should end.
+ */
+int group_run(s_conn *conn, s_request *request)
+{
+    s_group *group = &conn->group;
+    RETCODE rv;
+
+    if (!group->count)
+    {
+        if (!group->requests)
+        {
+            group->requests = (s_request **) malloc(group_size * sizeof(s_request *));
+            group->responses = (s_buffer *) malloc(group_size * sizeof(s_buffer));
+        }
+
+        // a driver without transactions runs it like any other request
+        rv = SQLSetConnectAttr(conn->dbh, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_OFF, SQL_IS_UINTEGER);
+        if (!IS_SQL_SUCCESS(rv))
+            return group_single(conn, request);
+
+        group->started = clock_usec();
+    }
+
+    buf_init(&group->responses[group->count]);
+    group->requests[group->count++] = request;
+
+    // a failed statement can leave the transaction unusable for the writes before it
+    if (!run_request(conn, request, request->sql, &group->responses[group->count - 1]))
+        return group_retry(conn);
+
+    if (group->count == group_size)
+        return group_commit(conn);
+
+    return 1;
+}
+
+// commit conn's group and send the responses held for it, or run its writes again one at a time if that fails
+int group_commit(s_conn *conn)
+{
+    s_group *group = &conn->group;
+    RETCODE rv;
+    int i;
+
+    if (!group->count)
+        return 1;
+
+    rv = SQLEndTran(SQL_HANDLE_DBC, conn->dbh, SQL_COMMIT);
+    if (!IS_SQL_SUCCESS(rv))
+        return group_retry(conn);
+
+    SQLSetConnectAttr(conn->dbh, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_ON, SQL_IS_UINTEGER);
+
+    for (i = 0; i < group->count; i++)
+    {
+        // another connection can have cached what it read before the commit
+        if (results.limit)
+            result_invalidate(group->requests[i]->sql);
+
+        output_response(&group->responses[i], group->requests[i], 1);
+        buf_free(&group->responses[i]);
+        request_free(group->requests[i]);
+    }
+
+    group->count = 0;
+
+    return 1;
+}
+
+/*
+ * Roll conn's group back and run its writes again with autocommit back on, each in a
+ * transaction of its own, dropping the responses held for them. Stops at the first one from
+ * stdin that fails, as it would have without --group-commit. Returns 0 then.
+ */
+int group_retry(s_conn *conn)
+{
+    s_group *group = &conn->group;
+    int i, count = group->count, ok = 1;
+
+    SQLEndTran(SQL_HANDLE_DBC, conn->dbh, SQL_ROLLBACK);
+    SQLSetConnectAttr(conn->dbh, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_ON, SQL_IS_UINTEGER);
+
+    // they run on their own now, see run_request() on a lost connection
+    group->count = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        buf_free(&group->responses[i]);
+
+        if (ok)
+            ok = group_single(conn, group->requests[i]);
+        else
+            request_free(group->requests[i]);
+    }
+
+    return ok;
+}
+
+// run request on its own and send its response, takes request; returns what output_response() does
+int group_single(s_conn *conn, s_request *request)
+{
+    s_buffer response;
+    int ok;
+
+    buf_init(&response);
+    ok = run_request(conn, request, request->sql, &response);
+    ok = output_response(&response, request, ok);
+    buf_free(&response);
+    request_free(request);
+
+    return ok;
+}
+
+/*
+ * --listen: take clients on a localhost TCP port, host:port or a Unix domain socket path
+ * (anything with a '/'), instead of stdin. Returns 0 after writing the error to stdout.
+ */
+int server_start(char *address)
+{
+    struct sockaddr_in in;
+#if !defined(WIN32)
+    struct sockaddr_un un;
+#endif
+    struct sockaddr *addr = (struct sockaddr *) &in;
+    socklen_t addr_len = sizeof(in);
+    char *colon = strrchr(address, ':');
+    int family = AF_INET, on = 1;
+
+#if defined(WIN32)
+    WSADATA wsa;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        error(&std_out, "listen", SQL_ERROR, SQL_HANDLE_ENV, SQL_NULL_HENV);
+        return 0;
+    }
+#else
+    // a client that hangs up while its response is being sent mustn't take the process with it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strchr(address, '/'))
+    {
+        memset(&un, 0, sizeof(un));
+        un.sun_family = family = AF_UNIX;
+        strncpy(un.sun_path, address, sizeof(un.sun_path) - 1);
+        addr = (struct sockaddr *) &un;
+        addr_len = sizeof(un);
+        unlink(address);
+    }
+    else
+#endif
+    {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons((unsigned short) atoi(colon ? colon + 1 : address));
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (colon)
+        {
+            *colon = 0;
+            in.sin_addr.s_addr = inet_addr(address);
+            *colon = ':';
+        }
+    }
+
+    mutex_init(&server.lock);
+
+    if ((server.sock = socket(family, SOCK_STREAM, 0)) == INVALID_SOCKET
+        || (family == AF_INET && setsockopt(server.sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on)) != 0)
+        || bind(server.sock, addr, addr_len) != 0
+        || listen(server.sock, SOMAXCONN) != 0)
+    {
+        error(&std_out, "listen", SQL_ERROR, SQL_HANDLE_ENV, SQL_NULL_HENV);
+        return 0;
+    }
+
+    // a loopback datagram socket connected to itself, which poll() works on everywhere
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_len = sizeof(in);
+
+    if ((server.wake = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET
+        || bind(server.wake, (struct sockaddr *) &in, addr_len) != 0
+        || getsockname(server.wake, (struct sockaddr *) &in, &addr_len) != 0
+        || connect(server.wake, (struct sockaddr *) &in, addr_len) != 0
+        || !socket_nonblocking(server.wake))
+    {
+        error(&std_out, "listen", SQL_ERROR, SQL_HANDLE_ENV, SQL_NULL_HENV);
+        return 0;
+    }
+
+    cond_init(&server.sent);
+
+    return 1;
+}
+
+// 0 if sock can't be made non-blocking
+int socket_nonblocking(SOCKET sock)
+{
+#if defined(WIN32)
+    u_long on = 1;
+
+    return (ioctlsocket(sock, FIONBIO, &on) == 0);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    return (flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0);
+#endif
+}
+
+/*
+ * --listen: wait for new clients and for input from the ones there are, queueing their
+ * requests for the workers as they arrive, one at a time per client, and send the output
+ * their sockets couldn't take when the workers queued it. Clients that are gone are dropped
+ * once their last response has been sent. Returns only if poll() fails.
+ */
+void server_main(void)
+{
+    struct pollfd *fds = NULL;
+    s_client **polled = NULL, *client, **link;
+    s_request *request;
+    char wake[16];
+    int size = 0, count, n;
+
+    for (;;)
+    {
+        mutex_lock(&server.lock);
+
+        for (link = &server.clients; (client = *link); )
+        {
+            if (client->broken)
+                client_flush(client);
+
+            if (client->closed && !client->busy && !client->out)
+            {
+                *link = client->next;
+
+                while ((request = client->waiting))
+                {
+                    client->waiting = request->next;
+                    request_free(request);
+                }
+
+                socket_close(client->sock);
+                free(client->in.buf);
+                free(client);
+                server.count--;
+            }
+            else
+                link = &client->next;
+        }
+
+        if (size < server.count + 2)
+        {
+            size = 2 * server.count + 16;
+            fds = (struct pollfd *) realloc(fds, size * sizeof(struct pollfd));
+            polled = (s_client **) realloc(polled, size * sizeof(s_client *));
+        }
+
+        fds[0].fd = server.sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = server.wake;
+        fds[1].events = POLLIN;
+        count = 2;
+
+        // a client busy with a request stops being read once the next ones have piled up
+        for (client = server.clients; client; client = client->next)
+        {
+            fds[count].events = 0;
+
+            if (!client->closed && !(client->busy && client->in.len - client->in.pos > INPUT_BLOCK))
+                fds[count].events |= POLLIN;
+
+            if (client->out)
+                fds[count].events |= POLLOUT;
+
+            if (fds[count].events)
+            {
+                fds[count].fd = client->sock;
+                polled[count++] = client;
+            }
+        }
+
+        mutex_unlock(&server.lock);
+
+        if ((n = poll(fds, count, LISTEN_POLL)) < 0)
+        {
+#if !defined(WIN32)
+            if (errno == EINTR)
+                continue;
+#endif
+            break;
+        }
+
+        // cursors left open by clients that went quiet expire meanwhile
+        cursor_sweep();
+
+        if (!n)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+            server_accept();
+
+        if (fds[1].revents)
+            while (recv(server.wake, wake, sizeof(wake), 0) > 0)
+                ;
+
+        for (n = 2; n < count; n++)
+        {
+            if (fds[n].revents & (POLLOUT | POLLERR | POLLHUP) && fds[n].events & POLLOUT)
+            {
+                mutex_lock(&server.lock);
+                client_flush(polled[n]);
+                mutex_unlock(&server.lock);
+            }
+
+            if (fds[n].revents & (POLLIN | POLLERR | POLLHUP) && fds[n].events & POLLIN)
+                server_read(polled[n]);
+        }
+    }
+
+    free(fds);
+    free(polled);
+}
+
+void server_accept(void)
+{
+    s_client *client;
+    SOCKET sock;
+
+    if ((sock = accept(server.sock, NULL, NULL)) == INVALID_SOCKET)
+        return;
+
+    // the workers and this thread send what the socket takes without waiting, see client_flush()
+    if (!socket_nonblocking(sock))
+    {
+        socket_close(sock);
+        return;
+    }
+
+    client = (s_client *) calloc(1, sizeof(s_client));
+    client->sock = sock;
+
+    mutex_lock(&server.lock);
+    client->next = server.clients;
+    server.clients = client;
+    server.count++;
+    mutex_unlock(&server.lock);
+
+    // greeted like stdin is once the connections are up
+    send(sock, "OK", 2, 0);
+}
+
+// what a client has sent since it was last read, its next request is queued if it's complete
+void server_read(s_client *client)
+{
+    s_reader *r = &client->in;
+    long n;
+
+    mutex_lock(&server.lock);
+    reader_room(r);
+
+    if ((n = recv(client->sock, r->buf + r->len, INPUT_BLOCK, 0)) < 0 && socket_blocked())
+        ;
+    else if (n <= 0)
+        client->closed = 1;
+    else
+    {
+        r->len += n;
+        client_next(client);
+    }
+
+    mutex_unlock(&server.lock);
+}
+
+/*
+ * Queue the next request of client once it has all arrived, unless one is still running.
+ * Requests are parsed as they arrive, so a CANCEL= is acted on right away; the ones after a
+ * request that is still running wait in client->waiting. With the server lock held.
+ */
+void client_next(s_client *client)
+{
+    s_request *request, **link;
+    long term;
+
+    for (;;)
+    {
+        if ((request = client->waiting) && !client->busy && !client->closed)
+        {
+            client->waiting = request->next;
+            client->waiting_count--;
+            request->next = NULL;
+            client->busy = 1;
+            queue_push(request);
+        }
+
+        if (client->ending || client->closed || client->waiting_count >= CLIENT_AHEAD || (term = request_end(&client->in)) < 0)
+            break;
+
+        request = (s_request *) calloc(1, sizeof(s_request));
+        request->client = client;
+
+        // a bad request or one without anything to run (eg CLOSE=0;) ends the client, as it ends stdin
+        if (!request_parse(&client->in, term, request)
+            || (!request->stats && !request->cursor && !request->sql[0] && !request->cancel[0]))
+        {
+            request_free(request);
+            client->ending = 1;
+        }
+        else if (request->cancel[0])
+        {
+            request_cancel(request);
+            request_free(request);
+        }
+        else
+        {
+            for (link = &client->waiting; *link; link = &(*link)->next)
+                ;
+
+            *link = request;
+            client->waiting_count++;
+        }
+    }
+
+    if (client->ending && !client->busy && !client->waiting)
+        client_close(client);
+}
+
+/*
+ * Queue the response to a request from a client for its socket. The client's next request
+ * is queued once all of it has been sent, so a client that doesn't read its responses holds
+ * up only itself. A failed request ends the client, the way it ends the daemon on stdin.
+ */
+void client_send(s_buffer *response, s_request *request, int ok)
+{
+    mutex_lock(&server.lock);
+    client_queue(request->client, response, 1, !ok);
+    mutex_unlock(&server.lock);
+}
+
+/*
+ * Queue a STREAM=1 frame of a request from client, the response it's part of isn't finished
+ * yet. The worker waits while more than CLIENT_QUEUED bytes are queued for the client, so a
+ * slow reader holds the worker and its connection only for a result it's streaming.
+ */
+void client_frame(s_buffer *frame, s_request *request)
+{
+    s_client *client = request->client;
+
+    mutex_lock(&server.lock);
+    client_queue(client, frame, 0, 0);
+
+    while (client->queued > CLIENT_QUEUED && !client->broken)
+        cond_wait(&server.sent, &server.lock);
+
+    mutex_unlock(&server.lock);
+}
+
+/*
+ * Move the output in b to the end of client's queue, leaving b empty, and send what the
+ * socket takes of it now. The rest is left to server_main(). With the server lock held.
+ */
+void client_queue(s_client *client, s_buffer *b, int last, int close)
+{
+    s_output *o = (s_output *) calloc(1, sizeof(s_output));
+
+    o->buf = *b;
+    o->last = last;
+    o->close = close;
+    buf_rewind(&o->buf);
+
+    buf_init(b);
+    b->spill = o->buf.spill;
+
+    if (client->out_tail)
+        client->out_tail->next = o;
+    else
+        client->out = o;
+
+    client->out_tail = o;
+    client->queued += o->buf.length;
+
+    client_flush(client);
+
+    if (client->out && !client->broken)
+        server_wake();
+}
+
+/*
+ * Send what client's socket takes of its queued output without waiting, the rest is sent
+ * when poll() finds the socket writable. Once the last of a response is out the client's
+ * next request is queued; after a failed send the output is dropped. With the server lock held.
+ */
+void client_flush(s_client *client)
+{
+    s_output *o;
+    long sent;
+
+    while ((o = client->out))
+    {
+        if (!client->broken && client->send_pos == client->send_len)
+        {
+            client->send_pos = 0;
+            client->send_len = buf_read(&o->buf, client->send_buf, sizeof(client->send_buf));
+        }
+
+        if (!client->broken && client->send_pos < client->send_len)
+        {
+            if ((sent = send(client->sock, (const char *) client->send_buf + client->send_pos, (int) (client->send_len - client->send_pos), 0)) > 0)
+            {
+                client->send_pos += sent;
+                continue;
+            }
+
+            if (sent < 0 && socket_blocked())
+                break;
+
+            client->broken = 1;
+            client_close(client);
+        }
+
+        // all of it is out, or there's nowhere for it to go
+        if (!(client->out = o->next))
+            client->out_tail = NULL;
+
+        client->queued -= o->buf.length;
+        client->send_pos = client->send_len = 0;
+
+        if (o->last)
+        {
+            client->busy = 0;
+
+            if (o->close)
+                client_close(client);
+
+            client_next(client);
+        }
+
+        buf_free(&o->buf);
+        free(o);
+    }
+
+    cond_broadcast(&server.sent);
+}
+
+// get server_main() out of poll() to look at the clients again, eg for output a worker queued
+void server_wake(void)
+{
+    send(server.wake, "", 1, 0);
+}
+
+// stop taking requests from client, it's closed and freed by server_main(); with the server lock held
+void client_close(s_client *client)
+{
+    if (!client->closed)
+        shutdown(client->sock, SHUT_RDWR);
+
+    client->closed = 1;
+}
+
+/*
+ * Execute sql for request with a statement from conn's cache, preparing it first if it isn't there,
+ * and params bound to its placeholders.
+ * Sets *sth to the statement, which belongs to the cache. Returns 0 after writing the error to out.
+ */
+int stmt_execute(s_conn *conn, char *sql, s_param *params, int param_count, SQLHSTMT *sth, s_request *request, s_buffer *out)
+{
+    RETCODE rv;
+    int hit, retry;
+
+    if (!(*sth = stmt_prepare(conn, sql, request, out, &hit)) || !params_bind(*sth, params, param_count, out))
+        return 0;
+
+    stmt_timeout(*sth, request);
+    conn_run(conn, request, *sth);
+
+    rv = (request->stopped ? SQL_ERROR : SQLExecute(*sth));
+
+    // a SELECT runs again on a new connection when it lost this one
+    if ((retry = conn_retry(conn, sth, 1, rv, request, out)))
+        return (retry > 0 && stmt_execute(conn, sql, params, param_count, sth, request, out));
+
+    // a cached plan can go stale, eg when a table is altered underneath it, so it's prepared again;
+    // only a SELECT runs once more, anything else gets the error, it can't be told what it did
+    if (!IS_SQL_SUCCESS(rv) && rv != SQL_NO_DATA && hit && !stmt_stopped(*sth, rv, request) && stmt_stale(*sth))
+    {
+        conn_run(conn, request, SQL_NULL_HSTMT);
+
+        if (!request->retry)
+        {
+            error(out, "SQLExecute", rv, SQL_HANDLE_STMT, *sth);
+            stmt_drop(&conn->cache, *sth);
+            *sth = SQL_NULL_HSTMT;
+            return 0;
+        }
+
+        stmt_drop(&conn->cache, *sth);
+
+        if (!(*sth = stmt_prepare(conn, sql, request, out, &hit)) || !params_bind(*sth, params, param_count, out))
+            return 0;
+
+        stmt_timeout(*sth, request);
+        conn_run(conn, request, *sth);
+
+        rv = (request->stopped ? SQL_ERROR : SQLExecute(*sth));
+    }
+
+    return !error(out, (stmt_stopped(*sth, rv, request) ? stop_names[request->stopped] : "SQLExecute"), rv, SQL_HANDLE_STMT, *sth);
+}
+
+// stmt_execute() without the statement cache, *sth is a statement of its own for the request
+int stmt_direct(s_conn *conn, char *sql, s_param *params, int param_count, SQLHSTMT *sth, s_request *request, s_buffer *out)
+{
+    RETCODE rv;
+    int retry;
+
+    rv = SQLAllocHandle(SQL_HANDLE_STMT, conn->dbh, sth);
+
+    if (!(retry = conn_retry(conn, sth, 0, rv, request, out)))
+    {
+        if (error(out, "SQLAllocHandle3", rv, SQL_HANDLE_DBC, conn->dbh) || !*sth || !params_bind(*sth, params, param_count, out))
+            return 0;
+
+        stmt_timeout(*sth, request);
+        conn_run(conn, request, *sth);
+
+        rv = (request->stopped ? SQL_ERROR : SQLExecDirect(*sth, (UCHAR *) sql, SQL_NTS));
+        retry = conn_retry(conn, sth, 0, rv, request, out);
+    }
+
+    // once more on a new connection, for a SELECT that lost this one
+    if (retry)
+        return (retry > 0 && stmt_direct(conn, sql, params, param_count, sth, request, out));
+
+    return !error(out, (stmt_stopped(*sth, rv, request) ? stop_names[request->stopped] : "SQLExecDirect"), rv, SQL_HANDLE_STMT, *sth);
+}
+
+/*
+ * Whether executing sth failed because its prepared plan no longer fits the database, which
+ * preparing it again fixes: 0A000 (PostgreSQL's "cached plan must not change result type"),
+ * 26000/26501 (the prepared statement is gone on the server) or MySQL's error 1615
+ * ("Prepared statement needs to be re-prepared").
+ */
+int stmt_stale(SQLHSTMT sth)
+{
+    SQLCHAR     sql_state[6], msg[SQL_MAX_MESSAGE_LENGTH];
+    SQLINTEGER  error_id;
+    SQLSMALLINT msg_len;
+
+    if (SQLGetDiagRec(SQL_HANDLE_STMT, sth, 1, sql_state, &error_id, msg, sizeof(msg), &msg_len) == SQL_NO_DATA)
+        return 0;
+
+    return (strcmp((char *) sql_state, "0A000") == 0
+            || strcmp((char *) sql_state, "26000") == 0
+            || strcmp((char *) sql_state, "26501") == 0
+            || (strcmp((char *) sql_state, "HY000") == 0 && error_id == 1615));
+}
+
+// whether a call on sth for request failed because it was cancelled or timed out (SQLSTATE HY008 or HYT00), which request->stopped then says
+int stmt_stopped(SQLHSTMT sth, RETCODE rv, s_request *request)
+{
+    SQLCHAR     sql_state[6], msg[SQL_MAX_MESSAGE_LENGTH];
+    SQLINTEGER  error_id;
+    SQLSMALLINT msg_len;
+
+    if (IS_SQL_SUCCESS(rv) || rv == SQL_NO_DATA)
+        return 0;
+
+    if (!request->stopped && SQLGetDiagRec(SQL_HANDLE_STMT, sth, 1, sql_state, &error_id, msg, sizeof(msg), &msg_len) != SQL_NO_DATA)
+    {
+        if (strcmp((char *) sql_state, "HY008") == 0)
+            request->stopped = STOP_CANCEL;
+        else if (strcmp((char *) sql_state, "HYT00") == 0)
+            request->stopped = STOP_TIMEOUT;
+    }
+
+    return request->stopped;
+}
+
+// TIMEOUT= (or --timeout) for the statements of request, set every time as cached statements keep it
+void stmt_timeout(SQLHSTMT sth, s_request *request)
+{
+    SQLULEN seconds = (request->timeout >= 0 ? request->timeout : query_timeout);
+
+    SQLSetStmtAttr(sth, SQL_ATTR_QUERY_TIMEOUT, (SQLPOINTER) seconds, 0);
+}
+
+/*
+ * Prepared statement for sql, from conn's cache when the same text has been
+ * prepared before, otherwise prepared now and added, replacing the least recently used
+ * one once the cache is full. Sets *hit when it came from the cache.
+ * Returns NULL after writing the error to out.
+ */
+SQLHSTMT stmt_prepare(s_conn *conn, char *sql, s_request *request, s_buffer *out, int *hit)
+{
+    s_stmt_cache *cache = &conn->cache;
+    s_stmt *stmt, *slot = NULL;
+    SQLHSTMT sth = SQL_NULL_HSTMT;
+    RETCODE rv;
+    char *key = strdup(sql);
+    unsigned long hash = hash_string(key);
+    int i, retry;
+
+    for (i = 0; i < cache->count; i++)
+    {
+        stmt = &cache->stmts[i];
+
+        if (stmt->hash == hash && strcmp(stmt->sql, key) == 0)
+        {
+            stmt->used = ++cache->tick;
+            cache->hits++;
+            *hit = 1;
+            free(key);
+            return stmt->sth;
+        }
+
+        if (!slot || stmt->used < slot->used)
+            slot = stmt;
+    }
+
+    cache->misses++;
+    *hit = 0;
+
+    rv = SQLAllocHandle(SQL_HANDLE_STMT, conn->dbh, &sth);
+
+    // drivers that prepare on the server find out about a lost connection here already
+    if (!(retry = conn_retry(conn, &sth, 0, rv, request, out)))
+    {
+        if (error(out, "SQLAllocHandle3", rv, SQL_HANDLE_DBC, conn->dbh) || !sth)
+            goto CLEANUP;
+
+        rv = SQLPrepare(sth, (SQLCHAR *) sql, SQL_NTS);
+        retry = conn_retry(conn, &sth, 0, rv, request, out);
+    }
+
+    if (retry)
+    {
+        free(key);
+        return (retry > 0 ? stmt_prepare(conn, sql, request, out, hit) : NULL);
+    }
+
+    if (error(out, "SQLPrepare", rv, SQL_HANDLE_STMT, sth))
+        goto CLEANUP;
+
+    if (!cache->stmts)
+        cache->stmts = (s_stmt *) calloc(cache->size, sizeof(s_stmt));
+
+    if (cache->count < cache->size)
+    {
+        slot = &cache->stmts[cache->count++];
+    }
+    else
+    {
+        SQLFreeHandle(SQL_HANDLE_STMT, slot->sth);
+        free(slot->sql);
+    }
+
+    slot->sql = key;
+    slot->hash = hash;
+    slot->sth = sth;
+    slot->used = ++cache->tick;
+
+    return sth;
+
+    CLEANUP:
+    if (sth)
+    {
+        // run_request() can't tell anymore once it's gone
+        if (conn_lost(conn, sth))
+            conn->lost = 1;
+
+        SQLFreeHandle(SQL_HANDLE_STMT, sth);
+    }
+
+    free(key);
+
+    return NULL;
+}
+
+// remove sth from the cache and free it
+void stmt_drop(s_stmt_cache *cache, SQLHSTMT sth)
+{
+    int i;
+
+    for (i = 0; i < cache->count; i++)
+    {
+        if (cache->stmts[i].sth == sth)
+        {
+            SQLFreeHandle(SQL_HANDLE_STMT, sth);
+            free(cache->stmts[i].sql);
+            cache->stmts[i] = cache->stmts[--cache->count];
+            break;
+        }
+    }
+}
+
+void stmt_cache_free(s_stmt_cache *cache)
+{
+    while (cache->count)
+        stmt_drop(cache, cache->stmts[cache->count - 1].sth);
+
+    free(cache->stmts);
+    cache->stmts = NULL;
+}
+
+// FNV-1a
+unsigned long hash_string(const char *str)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (*str)
+        hash = ((hash ^ (unsigned char) *str++) * 16777619UL) & 0xFFFFFFFFUL;
+
+    return hash;
+}
+
+/*
+ * Split a PARAMS value into statement parameters. The values are decoded into a copy of
+ * str kept after the parameters in the same allocation, so str stays as sent for a request
+ * that runs again (eg after a group commit is rolled back) and free(*params) frees both.
+ * Parameters are separated by ',' and written as type:value with the value percent-encoded,
+ * where type is i (integer), f (float), s (string) or b (binary). A type with no value is NULL.
+ * Returns the number of parameters, or -1 if the list is malformed.
+ */
+int params_parse(char *str, s_param **params)
+{
+    s_param *param;
+    char *p, *next, *value, *s, *w, *end;
+    int count = 0, n = 1;
+
+    *params = NULL;
+
+    if (!str[0])
+        return 0;
+
+    for (p = str; *p; p++)
+        if (*p == ',')
+            n++;
+
+    *params = (s_param *) calloc(1, n * sizeof(s_param) + strlen(str) + 1);
+    p = strcpy((char *) (*params + n), str);
+
+    for (; p; p = next)
+    {
+        param = &(*params)[count++];
+
+        if ((next = strchr(p, ',')))
+            *next++ = 0;
+
+        if (!p[0] || (p[1] && p[1] != ':'))
+            return -1;
+
+        value = (p[1] ? p + 2 : NULL);
+        param->len = SQL_NULL_DATA;
+
+        if (value)
+        {
+            for (s = w = value; *s; s++)
+            {
+                if (*s == '%' && s[1] && s[2])
+                {
+                    *w++ = (hex_digit_to_int(s[1]) << 4) | hex_digit_to_int(s[2]);
+                    s += 2;
+                }
+                else
+                    *w++ = *s;
+            }
+
+            *w = 0;
+            param->len = w - value;
+        }
+
+        switch (p[0])
+        {
+            case 'i':
+                param->c_type = SQL_C_SBIGINT;
+                param->sql_type = SQL_BIGINT;
+                param->size = 19;
+                param->data = &param->i;
+
+                if (value)
+                {
+                    param->i = strtoll(value, &end, 10);
+                    if (!value[0] || *end)
+                        return -1;
+                }
+                break;
+            case 'f':
+                param->c_type = SQL_C_DOUBLE;
+                param->sql_type = SQL_DOUBLE;
+                param->size = 15;
+                param->data = &param->f;
+
+                if (value)
+                {
+                    param->f = strtod(value, &end);
+                    if (!value[0] || *end)
+                        return -1;
+                }
+                break;
+            case 's':
+                param->c_type = SQL_C_CHAR;
+                param->sql_type = (param->len > PARAM_LONG ? SQL_LONGVARCHAR : SQL_VARCHAR);
+                param->size = (param->len > 0 ? param->len : 1);
+                param->data = value;
+                break;
+            case 'b':
+                param->c_type = SQL_C_BINARY;
+                param->sql_type = (param->len > PARAM_LONG ? SQL_LONGVARBINARY : SQL_VARBINARY);
+                param->size = (param->len > 0 ? param->len : 1);
+                param->data = value;
+                break;
+            default:
+                return -1;
+        }
+
+        // the indicator of fixed size types only says NULL or not
+        if (value && (p[0] == 'i' || p[0] == 'f'))
+            param->len = 0;
+    }
+
+    return count;
+}
+
+int params_bind(SQLHSTMT sth, s_param *params, int count, s_buffer *out)
+{
+    RETCODE rv;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        rv = SQLBindParameter(sth, (SQLUSMALLINT) (i + 1), SQL_PARAM_INPUT, params[i].c_type, params[i].sql_type,
+                              params[i].size, 0, params[i].data, (params[i].len > 0 ? params[i].len : 0), &params[i].len);
+        if (error(out, "SQLBindParameter", rv, SQL_HANDLE_STMT, sth))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * BULK="rows": run sql once per BATCH rows (default 1000) instead of once per row, with each
+ * parameter bound to an array of the batch's values (SQL_ATTR_PARAMSET_SIZE). The first line of
+ * rows gives the type of each column as PARAMS does, i, f, s or b, and the lines after it the
+ * values, separated and percent-encoded as the fields of a RESULT are. A field that is %00 alone
+ * is NULL, an empty one is an empty string or binary (and NULL for i and f, as there's no empty number).
+ * Writes ROWCOUNT= with the rows changed by all batches and BATCHES= with those of each. Rows
+ * that don't parse or a batch that fails end the response with the error, after the counts of
+ * the batches that were run before it and WRITTEN= with the rows of the failed batch that the
+ * driver reports were run. Returns 0 if the request failed.
+ */
+int bulk_run(s_conn *conn, char *sql, s_request *request, s_buffer *out)
+{
+    RETCODE rv;
+    SQLHSTMT sth = SQL_NULL_HSTMT;
+    SQLLEN row_count;
+    s_bulk_col *cols = NULL;
+    char *p = request->bulk_rows, *field, **fields = NULL, *counts = NULL;
+    const char *src = "BULK";
+    unsigned long batch = (request->batch ? request->batch : BULK_BATCH), n, total = 0, written = 0;
+    unsigned long counts_len = 0, counts_size = 0;
+    long len, *lens = NULL;
+    long long start;
+    SQLUSMALLINT *status = NULL;
+    int col_count = 0, i, end = 0, ok = 0;
+
+    if (batch > BULK_BATCH_MAX)
+        batch = BULK_BATCH_MAX;
+
+    // the types line, at most as many columns as there can be parameters
+    while (!end && (field = bulk_field(&p, &len, &end)))
+    {
+        if (len != 1 || !field[0] || !strchr("ifsb", field[0]) || col_count == 65535)
+        {
+            col_count = 0;
+            break;
+        }
+
+        cols = (s_bulk_col *) realloc(cols, (col_count + 1) * sizeof(s_bulk_col));
+        memset(&cols[col_count], 0, sizeof(s_bulk_col));
+        cols[col_count++].type = field[0];
+    }
+
+    if (!col_count || !end)
+    {
+        error(out, "BULK", SQL_ERROR, SQL_HANDLE_STMT, SQL_NULL_HSTMT);
+        goto CLEANUP;
+    }
+
+    rv = SQLAllocHandle(SQL_HANDLE_STMT, conn->dbh, &sth);
+    if (error(out, "SQLAllocHandle3", rv, SQL_HANDLE_DBC, conn->dbh) || !sth)
+        goto CLEANUP;
+
+    rv = SQLPrepare(sth, (UCHAR *) sql, SQL_NTS);
+    if (error(out, "SQLPrepare", rv, SQL_HANDLE_STMT, sth))
+        goto CLEANUP;
+
+    stmt_timeout(sth, request);
+    conn_run(conn, request, sth);
+
+    if (batch <= (size_t) -1 / sizeof(long) / col_count)
+    {
+        fields = (char **) malloc(batch * col_count * sizeof(char *));
+        lens = (long *) malloc(batch * col_count * sizeof(long));
+        status = (SQLUSMALLINT *) malloc(batch * sizeof(SQLUSMALLINT));
+    }
+
+    if (!fields || !lens || !status)
+    {
+        src = "malloc";
+        rv = SQL_ERROR;
+        goto FAILED;
+    }
+
+    // drivers that can't take arrays of parameters get the rows of a batch one at a time,
+    // the others say which rows of a batch were run in status
+    if (SQLSetStmtAttr(sth, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) (SQLULEN) batch, 0) == SQL_SUCCESS)
+        SQLSetStmtAttr(sth, SQL_ATTR_PARAM_STATUS_PTR, status, 0);
+    else
+    {
+        SQLSetStmtAttr(sth, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) 1, 0);
+        free(status);
+        status = NULL;
+    }
+
+    while (*p)
+    {
+        // a batch already sent can't be stopped, the ones after it aren't run
+        if (request_stopped(request))
+        {
+            src = stop_names[request->stopped];
+            rv = SQL_ERROR;
+            goto FAILED;
+        }
+
+        // the fields of the next batch of rows, decoded in place
+        start = timer_start(request);
+
+        for (n = 0; n < batch && *p; n++)
+        {
+            for (i = 0, end = 0; i < col_count && !end; i++)
+                fields[n * col_count + i] = bulk_field(&p, &lens[n * col_count + i], &end);
+
+            if (i < col_count || !end)
+                goto MALFORMED;
+        }
+
+        if (!bulk_fill(cols, col_count, fields, lens, n, &src))
+        {
+            rv = SQL_ERROR;
+            goto FAILED;
+        }
+
+        request->times.parse += timer_stop(request, start);
+
+        start = timer_start(request);
+        rv = bulk_execute(sth, cols, col_count, n, status, &row_count, &written, &src);
+        request->times.execute += timer_stop(request, start);
+
+        if (!IS_SQL_SUCCESS(rv))
+        {
+            if (stmt_stopped(sth, rv, request))
+                src = stop_names[request->stopped];
+
+            goto FAILED;
+        }
+
+        total += row_count;
+
+        if (counts_len + 32 > counts_size)
+            counts = (char *) realloc(counts, counts_size = 2 * counts_size + 1024);
+
+        counts_len += sprintf(counts + counts_len, "%s%ld", (counts_len ? "," : ""), (long) row_count);
+    }
+
+    request->times.rows = total;
+    buf_printf(out, "ROWCOUNT=%lu,BATCHES=\"%s\"", total, (counts ? counts : ""));
+    end_response(out, request);
+    ok = 1;
+    goto CLEANUP;
+
+    MALFORMED:
+    src = "BULK";
+    rv = SQL_ERROR;
+
+    FAILED:
+    // the batches before this one have been run, and written rows of this one
+    buf_printf(out, "ROWCOUNT=%lu,BATCHES=\"%s\",WRITTEN=%lu,", total, (counts ? counts : ""), written);
+    error(out, src, rv, SQL_HANDLE_STMT, (strcmp(src, "BULK") && strcmp(src, "malloc") ? sth : SQL_NULL_HSTMT));
+
+    CLEANUP:
+    conn_run(conn, request, SQL_NULL_HSTMT);
+
+    if (sth)
+        SQLFreeHandle(SQL_HANDLE_STMT, sth);
+
+    for (i = 0; i < col_count; i++)
+    {
+        free(cols[i].data);
+        free(cols[i].ind);
+    }
+
+    free(cols);
+    free(fields);
+    free(lens);
+    free(status);
+    free(counts);
+
+    return ok;
+}
+
+// the next field of BULK rows at *p, decoded in place; *end is set when it ends its row, NULL at the end of the rows
+char *bulk_field(char **p, long *len, int *end)
+{
+    char *s, *w, *field = *p;
+
+    if (!*field)
+        return NULL;
+
+    for (s = w = field; *s && *s != field_sep[0] && *s != rec_sep[0]; s++)
+    {
+        if (*s == '%' && s[1] && s[2])
+        {
+            *w++ = (hex_digit_to_int(s[1]) << 4) | hex_digit_to_int(s[2]);
+            s += 2;
+        }
+        else
+            *w++ = *s;
+    }
+
+    *end = (*s != field_sep[0]);
+    *p = (*s ? s + 1 : s);
+    *w = 0;
+    *len = w - field;
+
+    return field;
+}
+
+/*
+ * Copy the fields of a batch of n rows into the arrays of cols, and set the types they are
+ * bound as, strings and binaries as wide as the longest of them in the batch.
+ * Returns 0 if a number doesn't parse or the arrays can't be allocated, *src says which.
+ */
+int bulk_fill(s_bulk_col *cols, int col_count, char **fields, long *lens, unsigned long n, const char **src)
+{
+    s_bulk_col *col;
+    void *data, *ind;
+    SQLBIGINT i_value;
+    double f_value;
+    char *value, *end;
+    unsigned long row;
+    long len;
+    int i;
+
+    for (i = 0; i < col_count; i++)
+    {
+        col = &cols[i];
+
+        switch (col->type)
+        {
+            case 'i':
+                col->c_type = SQL_C_SBIGINT;
+                col->sql_type = SQL_BIGINT;
+                col->width = sizeof(SQLBIGINT);
+                break;
+            case 'f':
+                col->c_type = SQL_C_DOUBLE;
+                col->sql_type = SQL_DOUBLE;
+                col->width = sizeof(double);
+                break;
+            default:
+                for (col->width = 1, row = 0; row < n; row++)
+                    if (lens[row * col_count + i] > col->width)
+                        col->width = lens[row * col_count + i];
+
+                if (col->type == 's')
+                {
+                    col->c_type = SQL_C_CHAR;
+                    col->sql_type = (col->width > PARAM_LONG ? SQL_LONGVARCHAR : SQL_VARCHAR);
+                }
+                else
+                {
+                    col->c_type = SQL_C_BINARY;
+                    col->sql_type = (col->width > PARAM_LONG ? SQL_LONGVARBINARY : SQL_VARBINARY);
+                }
+        }
+
+        *src = "malloc";
+
+        if (n > (size_t) -1 / col->width)
+            return 0;
+
+        if ((data = realloc(col->data, n * col->width)))
+            col->data = (unsigned char *) data;
+
+        if ((ind = realloc(col->ind, n * sizeof(SQLLEN))))
+            col->ind = (SQLLEN *) ind;
+
+        if (!data || !ind)
+            return 0;
+
+        *src = "BULK";
+
+        for (row = 0; row < n; row++)
+        {
+            value = fields[row * col_count + i];
+            len = lens[row * col_count + i];
+
+            // %00 alone is NULL, an empty number too, an empty string or binary is a zero-length value
+            if ((len == 1 && !value[0]) || (!len && (col->type == 'i' || col->type == 'f')))
+            {
+                col->ind[row] = SQL_NULL_DATA;
+                continue;
+            }
+
+            // the indicator of fixed size types only says NULL or not
+            if (col->type == 'i')
+            {
+                i_value = strtoll(value, &end, 10);
+                memcpy(col->data + row * col->width, &i_value, sizeof(i_value));
+                len = 0;
+            }
+            else if (col->type == 'f')
+            {
+                f_value = strtod(value, &end);
+                memcpy(col->data + row * col->width, &f_value, sizeof(f_value));
+                len = 0;
+            }
+            else
+            {
+                memcpy(col->data + row * col->width, value, len);
+                end = "";
+            }
+
+            if (*end)
+                return 0;
+
+            col->ind[row] = len;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Bind and execute the n rows in the arrays of cols, as one array of parameter sets when
+ * there's a status array for them or else a row at a time, adding up the rows they changed in
+ * *row_count. When it fails *written has the rows that were run and *src says what failed.
+ */
+RETCODE bulk_execute(SQLHSTMT sth, s_bulk_col *cols, int col_count, unsigned long n, SQLUSMALLINT *status, SQLLEN *row_count, unsigned long *written, const char **src)
+{
+    RETCODE rv = SQL_SUCCESS;
+    SQLLEN changed;
+    unsigned long row, k;
+    int i, arrays = (status != NULL);
+
+    *row_count = 0;
+
+    if (arrays)
+    {
+        *src = "SQLSetStmtAttr";
+        rv = SQLSetStmtAttr(sth, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) (SQLULEN) n, 0);
+        if (!IS_SQL_SUCCESS(rv))
+            return rv;
+    }
+
+    for (row = 0; row < n; row += (arrays ? n : 1))
+    {
+        *src = "SQLBindParameter";
+
+        for (i = 0; i < col_count; i++)
+        {
+            rv = SQLBindParameter(sth, (SQLUSMALLINT) (i + 1), SQL_PARAM_INPUT, cols[i].c_type, cols[i].sql_type,
+                                  cols[i].width, 0, cols[i].data + row * cols[i].width, cols[i].width, cols[i].ind + row);
+            if (!IS_SQL_SUCCESS(rv))
+                return rv;
+        }
+
+        // the rows the driver doesn't get to stay unused
+        for (k = 0; arrays && k < n; k++)
+            status[k] = SQL_PARAM_UNUSED;
+
+        *src = "SQLExecute";
+        rv = SQLExecute(sth);
+
+        // an UPDATE or DELETE that matched nothing
+        if (rv == SQL_NO_DATA)
+            continue;
+
+        // the rows before this one, or those of the array the driver says went in
+        if (!IS_SQL_SUCCESS(rv))
+        {
+            for (*written = (arrays ? 0 : row), k = 0; arrays && k < n; k++)
+                *written += (status[k] == SQL_PARAM_SUCCESS || status[k] == SQL_PARAM_SUCCESS_WITH_INFO);
+
+            return rv;
+        }
+
+        if (IS_SQL_SUCCESS(SQLRowCount(sth, &changed)) && changed > 0)
+            *row_count += changed;
+    }
+
+    return SQL_SUCCESS;
+}
+
+void sql_fetch(SQLHSTMT sth, SQLSMALLINT col_count, s_buffer *stream, char *md5, unsigned long *total_len, s_request *request)
+{
+    SQLSMALLINT i;
+    SQLRETURN rv;
+    unsigned char *buffer;
+    s_digest digest;
+    s_col_data *col_data = (s_col_data *) malloc((col_count + 1) * sizeof(s_col_data));
+    s_columnar columnar, *c = (request->format == FORMAT_COLUMNAR ? &columnar : NULL);
+    SQLUINTEGER buffer_size = 0;
+    unsigned char has_blob = 0, has_long = 0, has_text = 0;
+    int rows = request->rows, valid;
+    // compress while fetching, unless the result is likely to be CACHED and never sent
+    // or its rows are needed for a DELTA
+    // (streamed results are compressed from the start, see run_request())
+    int zip = (request->zip && !request->md5[0] && !request->stream && !request->delta);
+
+    // col 0 is the bookmark column
+    // get info for each col
+
+    for (i = 1; i <= col_count; i++)
+    {
+        rv = SQLDescribeCol(sth, i,
+                            col_data[i].col_name,
+                            sizeof(col_data[i].col_name),
+                            &(col_data[i].col_name_len),
+                            &(col_data[i].data_type),
+                            &(col_data[i].col_size),
+                            &(col_data[i].decimal_digits),
+                            &(col_data[i].nullable));
+
+        //if (error(rv, SQL_HANDLE_STMT, sth))
+        //    log("problem binding column %d name: %s\n", i, col_data[i].col_name);
+
+        if ((SQLUINTEGER) col_data[i].col_size > buffer_size)
+            buffer_size = (SQLUINTEGER) col_data[i].col_size;
+
+        // long and unsized columns can't be bound to a fixed width, they force the SQLGetData path
+        if (col_data[i].col_size == 0 || col_data[i].col_size > FETCH_BIND_MAX)
+            has_long = 1;
+
+        switch (col_data[i].data_type)
+        {
+            case SQL_LONGVARCHAR:
+                col_data[i].data_type = SQL_CHAR;
+                has_blob = has_long = 1;
+                break;
+            case SQL_LONGVARBINARY:
+                has_long = 1;
+                // fall through
+            case SQL_BINARY:
+            case SQL_VARBINARY:
+                col_data[i].data_type = SQL_C_BINARY;
+                has_blob = has_text = 1;
+                break;
+            // FORMAT=columnar has the driver convert numbers and dates to C types, not text
+            case SQL_TINYINT:
+            case SQL_SMALLINT:
+            case SQL_INTEGER:
+            case SQL_BIGINT:
+                col_data[i].data_type = (c ? SQL_C_SBIGINT : SQL_C_CHAR);
+                break;
+            case SQL_REAL:
+            case SQL_FLOAT:
+            case SQL_DOUBLE:
+                col_data[i].data_type = (c ? SQL_C_DOUBLE : SQL_C_CHAR);
+                break;
+            case SQL_TYPE_DATE:
+            case SQL_TYPE_TIMESTAMP:
+                col_data[i].data_type = (c ? SQL_C_TYPE_TIMESTAMP : SQL_C_CHAR);
+                break;
+            default:
+                col_data[i].data_type = SQL_C_CHAR;
+                has_text = 1;
+                break;
+        }
+    }
+
+    *total_len = 0;
+
+    digest_init(&digest, request->hash);
+    digest.spent = (request->timing ? &request->times.hash : NULL);
+
+    if (c)
+    {
+        // the column names and types take the place of the header row
+        columnar_init(c, col_count, col_data, stream, &digest, total_len);
+        request->columnar = c;
+    }
+    else
+    {
+        // output header row
+        for (i = 1; i <= col_count; i++)
+        {
+            buffer = (unsigned char *) url_encode((char *) col_data[i].col_name, strlen((char *) col_data[i].col_name), 0, NULL);
+            buf_puts(stream, (char *) buffer);
+            free(buffer);
+            if (i < col_count)
+                buf_puts(stream, field_sep);
+        }
+
+        buf_puts(stream, rec_sep);
+    }
+
+    // increase column size for binary fields, and because of some misreporting of length
+    buffer_size = (buffer_size * 2) + 128;
+    if (has_blob && buffer_size < 32768)
+        buffer_size = 32768;
+    buffer = (unsigned char *) malloc(buffer_size);
+
+    if (rows < 1)
+        rows = FETCH_ROWS;
+
+    // a block never goes past the end of a FETCH=n page
+    if (request->fetch && (unsigned long) rows > request->fetch)
+        rows = (int) request->fetch;
+
+    // block fetch when every column can be bound, otherwise (or if the driver refuses) one row at a time;
+    // strings and binaries can be longer than their column size says, so only if the rest of them can be had
+    if (!has_long && (!has_text || request->getdata) && rows > 1
+        && sql_fetch_block(sth, col_count, col_data, stream, &digest, total_len, rows, zip, buffer, buffer_size, request))
+        rows = 0;
+
+    while (rows && !request_stopped(request))
+    {
+        if (request->fetch && request->times.rows >= request->fetch)
+        {
+            request->more = 1;
+            break;
+        }
+
+        rv = SQLFetch(sth);
+
+        if (IS_SQL_SUCCESS(rv))
+        {
+            for (i = 1; i <= col_count; i++)
+            {
+                valid = sql_get_cell(sth, i, col_data[i].data_type, buffer, buffer_size, stream, &digest, total_len, (c ? &c->cols[i] : NULL));
+
+                if (c)
+                    columnar_end(&c->cols[i], valid);
+                else if (i < col_count)
+                    buf_puts(stream, field_sep);
+            }
+
+            if (c)
+                columnar_row(c);
+            else
+                buf_puts(stream, rec_sep);
+
+            request->times.rows++;
+
+            if (zip)
+                zip_probe(stream, request, *total_len);
+
+            if (request->stream_out && stream->written >= STREAM_CHUNK)
+                stream_chunk(request->stream_out, stream, request, 0);
+        }
+        else
+        {
+            stmt_stopped(sth, rv, request);
+            break;
+        }
+    }
+
+    if (c)
+    {
+        // the last batch, then a batch of 0 rows to end the result
+        columnar_flush(c);
+        columnar_u64(c, 0);
+        columnar_free(c);
+        request->columnar = NULL;
+    }
+
+    free(col_data);
+    free(buffer);
+    digest_final(&digest, md5);
+}
+
+/*
+ * Write column i of the current row with SQLGetData, a buffer at a time until the driver has no
+ * more of it, to col with FORMAT=columnar or else encoded to stream. Returns 0 if it's NULL.
+ */
+int sql_get_cell(SQLHSTMT sth, SQLUSMALLINT i, SQLSMALLINT type, unsigned char *buffer, SQLLEN buffer_size, s_buffer *stream, s_digest *digest, unsigned long *total_len, s_column *col)
+{
+    SQLSMALLINT status, status_size;
+    SQLRETURN rv;
+    SQLLEN copy_len;
+    int valid = 0;
+
+    for (;;)
+    {
+        rv = SQLGetData(sth, i, type, buffer, buffer_size, &copy_len);
+
+        if (IS_SQL_SUCCESS(rv) && copy_len != SQL_NULL_DATA)
+            valid = 1;
+
+        if (IS_SQL_SUCCESS(rv) && copy_len != SQL_NULL_DATA && copy_len != 0)
+        {
+            copy_len = (copy_len > buffer_size) || (copy_len == SQL_NO_TOTAL) ? buffer_size : copy_len;
+
+            if (col)
+                columnar_put(col, buffer, copy_len);
+            else
+            {
+                *total_len += encode_buf(stream, buffer, copy_len, type == SQL_C_BINARY);
+                digest_update(digest, buffer, copy_len);
+            }
+
+            if (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &status_size) != SQL_NO_DATA)
+                continue;
+        }
+
+        break;
+    }
+
+//~ do {
+    //~ rv = SQLGetData(sth, i, col_data[i].data_type, buffer, buffer_size, &copy_len);
+//~ } while (rv == SQL_SUCCESS_WITH_INFO && SQLGetDiagField(SQL_HANDLE_STMT, sth, 1, i, &status, SQL_INTEGER, &statuslen) != SQL_NO_DATA);
+
+    return valid;
+}
+
+/*
+ * Fetch the remaining rows of sth (or the rest of a FETCH=n page) in blocks of up to rows rows, with every column
+ * bound column-wise through SQLBindCol, and write them exactly as the SQLGetData loop
+ * in sql_fetch() would, including the switch to compression when zip is set.
+ * Only valid when no column is long (see FETCH_BIND_MAX). A value longer than its column
+ * size said doesn't fit its bound width, its row is positioned on with SQLSetPos and the
+ * whole of it fetched with SQLGetData into buffer instead, see conn_getdata().
+ * Returns 0 without fetching anything if the driver rejects the block cursor
+ * attributes or bindings, so the caller can fall back to fetching one row at a time.
+ */
+int sql_fetch_block(SQLHSTMT sth, SQLSMALLINT col_count, s_col_data *col_data, s_buffer *stream, s_digest *digest, unsigned long *total_len, int rows, int zip, unsigned char *buffer, SQLLEN buffer_size, s_request *request)
+{
+    SQLSMALLINT i;
+    SQLRETURN rv;
+    SQLULEN r = 0, fetched = 0;
+    SQLUSMALLINT *row_status;
+    SQLLEN copy_len, fits, row_width = 0;
+    unsigned char *value;
+    s_columnar *c = request->columnar;
+    int bound = 1, more = 1, valid;
+
+    for (i = 1; i <= col_count; i++)
+    {
+        // twice the column size and then some, for drivers that misreport it a little;
+        // C types (FORMAT=columnar) have a size of their own
+        if (col_data[i].data_type == SQL_C_SBIGINT || col_data[i].data_type == SQL_C_DOUBLE)
+            col_data[i].width = 8;
+        else if (col_data[i].data_type == SQL_C_TYPE_TIMESTAMP)
+            col_data[i].width = sizeof(SQL_TIMESTAMP_STRUCT);
+        else
+            col_data[i].width = (col_data[i].col_size * 2) + 128;
+
+        row_width += col_data[i].width + sizeof(SQLLEN);
+    }
+
+    if ((SQLLEN) rows * row_width > FETCH_BLOCK_SIZE)
+        rows = FETCH_BLOCK_SIZE / row_width;
+
+    if (rows < 2)
+        return 0;
+
+    rv = SQLSetStmtAttr(sth, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) (SQLULEN) rows, 0);
+    if (!IS_SQL_SUCCESS(rv))
+        return 0;
+
+    // the driver may have substituted a smaller array size
+    rv = SQLGetStmtAttr(sth, SQL_ATTR_ROW_ARRAY_SIZE, &r, 0, NULL);
+    if (IS_SQL_SUCCESS(rv) && r > 0 && r < (SQLULEN) rows)
+        rows = (int) r;
+
+    row_status = (SQLUSMALLINT *) malloc(rows * sizeof(SQLUSMALLINT));
+    SQLSetStmtAttr(sth, SQL_ATTR_ROW_STATUS_PTR, row_status, 0);
+    SQLSetStmtAttr(sth, SQL_ATTR_ROWS_FETCHED_PTR, &fetched, 0);
+
+    for (i = 1; i <= col_count; i++)
+    {
+        col_data[i].data = (unsigned char *) malloc(rows * col_data[i].width);
+        col_data[i].ind = (SQLLEN *) malloc(rows * sizeof(SQLLEN));
+
+        rv = SQLBindCol(sth, i, col_data[i].data_type, col_data[i].data, col_data[i].width, col_data[i].ind);
+        if (!IS_SQL_SUCCESS(rv))
+            bound = 0;
+    }
+
+    while (bound && more && !request_stopped(request))
+    {
+        // the last block of a FETCH=n page is cut short so it ends right after row n,
+        // if the driver can't do that the page ends here instead
+        if (request->fetch && request->fetch - request->times.rows < (SQLULEN) rows)
+        {
+            if (request->times.rows >= request->fetch ||
+                !IS_SQL_SUCCESS(SQLSetStmtAttr(sth, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) (SQLULEN) (request->fetch - request->times.rows), 0)))
+            {
+                request->more = 1;
+                break;
+            }
+        }
+
+        rv = SQLFetch(sth);
+
+        if (!IS_SQL_SUCCESS(rv))
+        {
+            stmt_stopped(sth, rv, request);
+            break;
+        }
+
+        for (r = 0; r < fetched; r++)
+        {
+            // SQLFetch fails on a bad row in the single row path, so stop here too
+            if (row_status[r] == SQL_ROW_ERROR || row_status[r] == SQL_ROW_NOROW)
+            {
+                more = 0;
+                break;
+            }
+
+            for (i = 1; i <= col_count; i++)
+            {
+                copy_len = col_data[i].ind[r];
+                value = col_data[i].data + (r * col_data[i].width);
+                valid = (copy_len != SQL_NULL_DATA);
+                // the bytes that fit, char data has its terminator too
+                fits = col_data[i].width - (col_data[i].data_type == SQL_C_CHAR ? 1 : 0);
+
+                // a string or binary cut short, the whole of it from SQLGetData instead
+                if ((col_data[i].data_type == SQL_C_CHAR || col_data[i].data_type == SQL_C_BINARY)
+                    && (copy_len > fits || copy_len == SQL_NO_TOTAL)
+                    && IS_SQL_SUCCESS(SQLSetPos(sth, (SQLSETPOSIROW) (r + 1), SQL_POSITION, SQL_LOCK_NO_CHANGE)))
+                {
+                    valid = sql_get_cell(sth, i, col_data[i].data_type, buffer, buffer_size, stream, digest, total_len, (c ? &c->cols[i] : NULL));
+                }
+                else if (copy_len != SQL_NULL_DATA && copy_len != 0)
+                {
+                    if (copy_len >= col_data[i].width || copy_len == SQL_NO_TOTAL)
+                        copy_len = fits;
+
+                    if (c)
+                        columnar_put(&c->cols[i], value, copy_len);
+                    else
+                    {
+                        *total_len += encode_buf(stream, value, copy_len, col_data[i].data_type == SQL_C_BINARY);
+                        digest_update(digest, value, copy_len);
+                    }
+                }
+
+                if (c)
+                    columnar_end(&c->cols[i], valid);
+                else if (i < col_count)
+                    buf_puts(stream, field_sep);
+            }
+
+            if (c)
+                columnar_row(c);
+            else
+                buf_puts(stream, rec_sep);
+
+            request->times.rows++;
+        }
+
+        if (zip)
+            zip_probe(stream, request, *total_len);
+
+        if (request->stream_out && stream->written >= STREAM_CHUNK)
+            stream_chunk(request->stream_out, stream, request, 0);
+    }
+
+    // leave the statement as a plain single row cursor
+    SQLFreeStmt(sth, SQL_UNBIND);
+    SQLSetStmtAttr(sth, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER) 1, 0);
+    SQLSetStmtAttr(sth, SQL_ATTR_ROW_STATUS_PTR, NULL, 0);
+    SQLSetStmtAttr(sth, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+
+    for (i = 1; i <= col_count; i++)
+    {
+        free(col_data[i].data);
+        free(col_data[i].ind);
+    }
+
+    free(row_status);
+
+    return bound;
+}
+
+/*
+ * FORMAT=columnar, a result as typed column-major batches instead of text rows. All
+ * integers are little-endian, every buffer is preceded by its length and padded to a
+ * multiple of 8 bytes, so the buffers can be used as Arrow arrays where they are:
+ *
+ *   u64 column count, then for each column
+ *       buffer with its Arrow format string, buffer with its name
+ *   for each batch
+ *       u64 row count (0 ends the result), then for each column
+ *           u64 null count, validity bitmap buffer, values buffer
+ *           and for "u" and "z" columns the data buffer the values are 32 bit offsets into
+ *
+ * Integers are "l" (int64), floating point "g" (float64), dates and timestamps "tsu:"
+ * (microseconds since 1970-01-01, no time zone), binary "z" and everything else "u",
+ * text as the driver returns it.
+ */
+void columnar_init(s_columnar *c, SQLSMALLINT col_count, s_col_data *col_data, s_buffer *stream, s_digest *digest, unsigned long *total_len)
+{
+    s_bytes b = {0};
+    s_column *col;
+    SQLSMALLINT i;
+    unsigned int zero = 0;
+
+    memset(c, 0, sizeof(s_columnar));
+    c->cols = (s_column *) calloc(col_count + 1, sizeof(s_column));
+    c->col_count = col_count;
+    c->stream = stream;
+    c->digest = digest;
+    c->total_len = total_len;
+
+    columnar_u64(c, col_count);
+
+    for (i = 1; i <= col_count; i++)
+    {
+        col = &c->cols[i];
+        col->c_type = col_data[i].data_type;
+
+        switch (col->c_type)
+        {
+            case SQL_C_SBIGINT:
+                col->format = "l";
+                break;
+            case SQL_C_DOUBLE:
+                col->format = "g";
+                break;
+            case SQL_C_TYPE_TIMESTAMP:
+                col->format = "tsu:";
+                break;
+            case SQL_C_BINARY:
+                col->format = "z";
+                break;
+            default:
+                col->format = "u";
+                break;
+        }
+
+        // variable length values start with the offset of the first one
+        if (col->format[0] == 'u' || col->format[0] == 'z')
+            bytes_add(&col->values, &zero, 4);
+
+        b.data = (unsigned char *) col->format;
+        b.len = strlen(col->format);
+        columnar_buffer(c, &b);
+
+        b.data = col_data[i].col_name;
+        b.len = strlen((char *) col_data[i].col_name);
+        columnar_buffer(c, &b);
+    }
+}
+
+// append to the value of the current row, a fixed size value is converted and stored whole
+void columnar_put(s_column *col, const void *value, SQLLEN len)
+{
+    const SQL_TIMESTAMP_STRUCT *ts;
+    long long usec, y, m, days;
+
+    switch (col->c_type)
+    {
+        case SQL_C_SBIGINT:
+        case SQL_C_DOUBLE:
+            bytes_le(&col->values, value, 8);
+            break;
+        case SQL_C_TYPE_TIMESTAMP:
+            // days from the civil date, the Gregorian calendar made to start in March
+            ts = (const SQL_TIMESTAMP_STRUCT *) value;
+            y = ts->year - (ts->month <= 2);
+            m = ts->month + (ts->month > 2 ? -3 : 9);
+            days = 365 * y + (y >= 0 ? y : y - 3) / 4 - (y >= 0 ? y : y - 99) / 100 + (y >= 0 ? y : y - 399) / 400
+                 + (153 * m + 2) / 5 + ts->day - 1 - 719468;
+            usec = ((days * 24 + ts->hour) * 60 + ts->minute) * 60 + ts->second;
+            usec = usec * 1000000 + ts->fraction / 1000;
+            bytes_le(&col->values, &usec, 8);
+            break;
+        default:
+            bytes_add(&col->data, value, len);
+            break;
+    }
+}
+
+// finish the value of the current row, NULL unless valid is set
+void columnar_end(s_column *col, int valid)
+{
+    static const unsigned char zero[8] = {0};
+    unsigned long row = col->rows++;
+    unsigned int offset;
+
+    if (row % 8 == 0)
+        bytes_add(&col->validity, zero, 1);
+
+    if (valid)
+        col->validity.data[row / 8] |= 1 << (row % 8);
+    else
+        col->nulls++;
+
+    if (col->format[0] == 'u' || col->format[0] == 'z')
+    {
+        offset = (unsigned int) col->data.len;
+        bytes_le(&col->values, &offset, 4);
+    }
+    else if (col->values.len < col->rows * 8)
+        bytes_add(&col->values, zero, 8);
+}
+
+// count a finished row, sending the batch once it's full
+void columnar_row(s_columnar *c)
+{
+    if (++c->rows >= COLUMNAR_BATCH)
+        columnar_flush(c);
+}
+
+// write out the rows collected so far as a batch and start the next one
+void columnar_flush(s_columnar *c)
+{
+    s_column *col;
+    SQLSMALLINT i;
+    unsigned int zero = 0;
+
+    if (!c->rows)
+        return;
+
+    columnar_u64(c, c->rows);
+
+    for (i = 1; i <= c->col_count; i++)
+    {
+        col = &c->cols[i];
+        columnar_u64(c, col->nulls);
+        columnar_buffer(c, &col->validity);
+        columnar_buffer(c, &col->values);
+
+        col->rows = col->nulls = col->validity.len = col->values.len = 0;
+
+        if (col->format[0] == 'u' || col->format[0] == 'z')
+        {
+            columnar_buffer(c, &col->data);
+            col->data.len = 0;
+            bytes_add(&col->values, &zero, 4);
+        }
+    }
+
+    c->rows = 0;
+}
+
+void columnar_free(s_columnar *c)
+{
+    SQLSMALLINT i;
+
+    for (i = 1; i <= c->col_count; i++)
+    {
+        free(c->cols[i].validity.data);
+        free(c->cols[i].values.data);
+        free(c->cols[i].data.data);
+    }
+
+    free(c->cols);
+}
+
+// everything written goes into the hash, the same as the text values do; as it is, see send_data()
+void columnar_write(s_columnar *c, const void *data, unsigned long len)
+{
+    buf_write(c->stream, data, len);
+    *c->total_len += len;
+    digest_update(c->digest, (unsigned char *) data, len);
+}
+
+// a buffer: its length, its content and padding up to the next multiple of 8
+void columnar_buffer(s_columnar *c, s_bytes *b)
+{
+    static const unsigned char zero[8] = {0};
+
+    columnar_u64(c, b->len);
+
+    if (b->len)
+        columnar_write(c, b->data, b->len);
+
+    if (b->len % 8)
+        columnar_write(c, zero, 8 - b->len % 8);
+}
+
+void columnar_u64(s_columnar *c, unsigned long long v)
+{
+    unsigned char le[8];
+    int i;
+
+    for (i = 0; i < 8; i++, v >>= 8)
+        le[i] = (unsigned char) v;
+
+    columnar_write(c, le, 8);
+}
+
+void bytes_add(s_bytes *b, const void *data, unsigned long len)
+{
+    if (b->len + len > b->size)
+        b->data = (unsigned char *) realloc(b->data, b->size = (b->len + len) * 2 + 64);
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// append a number of size bytes in host order as little-endian
+void bytes_le(s_bytes *b, const void *value, int size)
+{
+    static const union { unsigned short n; unsigned char first; } host = {1};
+    const unsigned char *p = (const unsigned char *) value;
+    unsigned char le[8];
+    int i;
+
+    if (host.first)
+    {
+        bytes_add(b, value, size);
+        return;
+    }
+
+    for (i = 0; i < size; i++)
+        le[i] = p[size - 1 - i];
+
+    bytes_add(b, le, size);
+}
+
+void digest_init(s_digest *digest, int type)
+{
+    digest->type = type;
+    digest->spent = NULL;
+
+    if (type == HASH_XXH64)
+        XXH64Init(&digest->xxh, 0);
+    else
+        MD5Init(&digest->md5);
+}
+
+void digest_update(s_digest *digest, unsigned char *data, unsigned len)
+{
+    long long start = (digest->spent ? clock_usec() : 0);
+
+    if (digest->type == HASH_XXH64)
+        XXH64Update(&digest->xxh, data, len);
+    else
+        MD5Update(&digest->md5, data, len);
+
+    if (digest->spent)
+        *digest->spent += clock_usec() - start;
+}
+
+// finish the hash and write it to hex as upper case hex digits (32 for MD5, 16 for XXH64)
+void digest_final(s_digest *digest, char *hex)
+{
+    unsigned char raw[16];
+
+    if (digest->type == HASH_XXH64)
+    {
+        XXH64Final(raw, &digest->xxh);
+        url_encode((char *) raw, 8, 1, hex);
+    }
+    else
+    {
+        MD5Final(raw, &digest->md5);
+        url_encode((char *) raw, 16, 1, hex);
+    }
+}
+
+/*
+ * Read the next request from stdin: KEY=value pairs separated by ',' and terminated by ';'.
+ * Quoted values are percent-decoded, outside quotes only alphanumerics count.
+ * stdin is read in blocks into input and each request is parsed in place once its
+ * terminator has arrived, so statements can be any length.
+ * Returns 0 at the end of input, on a bad request or an unknown key (eg CLOSE).
+ */
+int get_request(s_request *request)
+{
+    s_reader *r = &input;
+    long term, n;
+
+    while ((term = request_end(r)) < 0)
+    {
+        reader_room(r);
+
+        if ((n = READ_INPUT(r->buf + r->len, INPUT_BLOCK)) <= 0)
+            return 0;
+
+        r->len += n;
+    }
+
+    return request_parse(r, term, request);
+}
+
+// make room for INPUT_BLOCK more bytes of input in r, keeping the unparsed part of the buffer
+void reader_room(s_reader *r)
+{
+    if (r->pos)
+    {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->scan -= r->pos;
+        r->pos = 0;
+    }
+
+    if (r->size - r->len < INPUT_BLOCK)
+        r->buf = (char *) realloc(r->buf, r->size += (r->size > INPUT_BLOCK ? r->size : INPUT_BLOCK));
+}
+
+/*
+ * Parse the request in r that ends at term (see request_end()) into request, in place.
+ * Returns 0 on a bad request or an unknown key.
+ */
+int request_parse(s_reader *r, long term, s_request *request)
+{
+    char *p, *end, *key, *value = NULL, *w, c;
+    long long start;
+    int ok = 1, raw = 0;
+
+    request->zip = request->rows = request->id[0] = request->md5[0] = 0;
+    request->ttl = -1;
+    request->hash = HASH_MD5;
+    request->timing = request->stats = request->stream = 0;
+    request->fetch = request->cursor = 0;
+    request->format = FORMAT_TEXT;
+    request->codec = CODEC_DEFLATE;
+    request->codec_echo = 0;
+    request->delta = request->bulk = 0;
+    request->batch = 0;
+    request->timeout = -1;
+    request->deadline = request->stopped = request->cancel[0] = 0;
+    memset(&request->times, 0, sizeof(s_timing));
+
+    if (!request->sql)
+        request->sql = (char *) calloc(request->sql_size = 1, 1);
+
+    request->sql[0] = 0;
+
+    if (request->params)
+        request->params[0] = 0;
+
+    start = clock_usec();
+
+    p = key = w = r->buf + r->pos;
+    end = r->buf + term;
+    r->pos = term + 1;
+
+    // keys and decoded values are written back over the input, w never passes p
+    for (; ok && p <= end; p++)
+    {
+        c = *p;
+
+        if (c == '=' && !value)
+        {
+            *w = 0;
+            value = w = p + 1;
+
+            // PARAMS keeps its encoding until the separators between values have been found
+            raw = (strcmp(key, "PARAMS") == 0);
+        }
+        else if (c == ',' || c == ';')
+        {
+            if (!value)
+                return 0;
+
+            *w = 0;
+            ok = set_request_field(request, key, value, w - value);
+            key = w = p + 1;
+            value = NULL;
+        }
+        else if (c == '"' && value)
+        {
+            for (p++; p < end && *p != '"'; p++)
+            {
+                if (*p == '%' && end - p > 2 && !raw)
+                {
+                    *w++ = (hex_digit_to_int(p[1]) << 4) | hex_digit_to_int(p[2]);
+                    p += 2;
+                }
+                else
+                    *w++ = *p;
+            }
+        }
+        else if (isalnum((unsigned char) c))
+            *w++ = c;
+    }
+
+    request->times.parse = clock_usec() - start;
+
+    return ok;
+}
+
+// offset of the ';' ending the request at r->pos, or -1 if it hasn't been read yet
+long request_end(s_reader *r)
+{
+    char *p, *end, *q, *t;
+
+    if (!r->buf)
+        return -1;
+
+    for (p = r->buf + r->scan, end = r->buf + r->len; p < end; p = q + 1)
+    {
+        q = (char *) memchr(p, '"', end - p);
+
+        if (r->quoted)
+        {
+            if (!q)
+                break;
+
+            r->quoted = 0;
+        }
+        else if ((t = (char *) memchr(p, ';', (q ? q : end) - p)))
+        {
+            r->scan = t + 1 - r->buf;
+            return t - r->buf;
+        }
+        else if (!q)
+            break;
+        else
+            r->quoted = 1;
+    }
+
+    r->scan = r->len;
+    return -1;
+}
+
+// store one decoded KEY=value pair, returns 0 for an unknown key
+int set_request_field(s_request *request, const char *key, const char *value, unsigned long len)
+{
+    if (strcmp(key, "SQL") == 0)
+        store_string(&request->sql, &request->sql_size, value, len);
+    else if (strcmp(key, "PARAMS") == 0)
+        store_string(&request->params, &request->params_size, value, len);
+    else if (strcmp(key, "BULK") == 0)
+    {
+        store_string(&request->bulk_rows, &request->bulk_size, value, len);
+        request->bulk = 1;
+    }
+    else if (strcmp(key, "BATCH") == 0)
+        request->batch = strtoul(value, NULL, 10);
+    else if (strcmp(key, "ID") == 0)
+    {
+        strncpy(request->id, value, sizeof(request->id) - 1);
+        request->id[sizeof(request->id) - 1] = 0;
+    }
+    else if (strcmp(key, "CANCEL") == 0)
+    {
+        strncpy(request->cancel, value, sizeof(request->cancel) - 1);
+        request->cancel[sizeof(request->cancel) - 1] = 0;
+    }
+    else if (strcmp(key, "MD5") == 0)
+    {
+        strncpy(request->md5, value, sizeof(request->md5) - 1);
+        request->md5[sizeof(request->md5) - 1] = 0;
+    }
+    else if (strcmp(key, "ZIP") == 0)
+        request->zip = atoi(value);
+    else if (strcmp(key, "CODEC") == 0)
+    {
+        request->codec = codec_parse(value);
+        request->codec_echo = 1;
+    }
+    else if (strcmp(key, "ROWS") == 0)
+        request->rows = atoi(value);
+    else if (strcmp(key, "TTL") == 0)
+        request->ttl = atoi(value);
+    else if (strcmp(key, "TIMEOUT") == 0)
+        request->timeout = atoi(value);
+    else if (strcmp(key, "STATS") == 0)
+        request->stats = atoi(value);
+    else if (strcmp(key, "DELTA") == 0)
+        request->delta = atoi(value);
+    else if (strcmp(key, "STREAM") == 0)
+        request->stream = atoi(value);
+    else if (strcmp(key, "FETCH") == 0)
+        request->fetch = strtoul(value, NULL, 10);
+    else if (strcmp(key, "CURSOR") == 0)
+        request->cursor = strtoul(value, NULL, 10);
+    else if (strcmp(key, "TIMING") == 0)
+        request->timing = atoi(value);
+    else if (strcmp(key, "FORMAT") == 0)
+        request->format = (strcasecmp(value, "columnar") == 0 ? FORMAT_COLUMNAR : FORMAT_TEXT);
+    else if (strcmp(key, "HASH") == 0)
+        request->hash = (strcasecmp(value, "XXH64") == 0 ? HASH_XXH64 : HASH_MD5);
+    else
+        return 0;
+
+    return 1;
+}
+
+// copy value into *dest, growing it as needed
+void store_string(char **dest, unsigned long *size, const char *value, unsigned long len)
+{
+    if (len + 1 > *size)
+        *dest = (char *) realloc(*dest, *size = len + 1);
+
+    memcpy(*dest, value, len + 1);
+}
+
+// percent encode control characters and the protocol delimiters, appended to a result buffer
+// (straight into its last chunk when it's in memory and there's room, otherwise through buf_write()),
+// binary values with encode_scalar(): about one byte in seven of them is escaped, too many for the
+// SIMD kernels to gain on
+long encode_buf(s_buffer *dest, unsigned char *b, long len, int binary)
+{
+    long (*kernel)(unsigned char *, const unsigned char *, long) = (binary ? encode_scalar : encode_mem);
+    unsigned char encode[3 * ENCODE_BLOCK + 32], *room;
+    unsigned long room_len;
+    long i, k, m, n = 0;
+
+    for (i = 0; i < len; i += m)
+    {
+        m = (len - i < ENCODE_BLOCK ? len - i : ENCODE_BLOCK);
+
+        // as much as surely fits in what's left of the chunk, once it's nearly full through buf_write() into the next
+        if ((room_len = buf_room(dest, &room)) >= 3 * 64 + 32)
+        {
+            if (3 * m + 32 > (long) room_len)
+                m = (room_len - 32) / 3;
+
+            k = kernel(room, b + i, m);
+            buf_wrote(dest, k);
+        }
+        else
+        {
+            k = kernel(encode, b + i, m);
+            buf_write(dest, encode, k);
+        }
+
+        n += k;
+    }
+
+    return n;
+}
+
+// pick the widest encode kernel the cpu supports, and fill encode_table
+void encode_init(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++)
+    {
+        encode_table[c][0] = (encode_map[c] ? '%' : c);
+        encode_table[c][1] = hex_digits[c >> 4];
+        encode_table[c][2] = hex_digits[c & 15];
+    }
+
+    encode_mem = encode_scalar;
+
+#if defined(ENCODE_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        encode_mem = encode_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        encode_mem = encode_sse2;
+#endif
+}
+
+/*
+ * Encode len bytes of src into dest, which must have room for 3 * len + 32 bytes
+ * (the kernels store past what they keep). Returns the number of bytes written to dest.
+ */
+long encode_scalar(unsigned char *dest, const unsigned char *src, long len)
+{
+    unsigned char *d = dest;
+    long i;
+
+    // every byte is stored as 4 from encode_table and d moves on by 1 or 3, without a branch to mispredict
+    for (i = 0; i < len; i++)
+    {
+        memcpy(d, encode_table[src[i]], 4);
+        d += 1 + 2 * encode_map[src[i]];
+    }
+
+    return d - dest;
+}
+
+#if defined(ENCODE_SIMD)
+/*
+ * encode_scalar() 16 and 32 bytes at a time: blocks without anything to escape are
+ * stored straight through, otherwise encode_block() copies the clean runs between
+ * the escapes found in the compare mask. A block with more than ENCODE_DENSE escapes
+ * hands the next ENCODE_DENSE_RUN bytes to encode_scalar(), escape heavy data doesn't
+ * gain from the compares.
+ */
+__attribute__((target("sse2")))
+long encode_sse2(unsigned char *dest, const unsigned char *src, long len)
+{
+    const __m128i ctl = _mm_set1_epi8(31), quote = _mm_set1_epi8('"'), pct = _mm_set1_epi8('%'),
+                  comma = _mm_set1_epi8(','), semi = _mm_set1_epi8(';'), eq = _mm_set1_epi8('=');
+    __m128i x, m, block[2] = {{0}};
+    unsigned int escapes;
+    unsigned char *d = dest;
+    long i, n;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        x = _mm_loadu_si128((const __m128i *) (src + i));
+
+        // x <= 31 unsigned, or one of the delimiters
+        m = _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x);
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, pct)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, comma), _mm_cmpeq_epi8(x, semi)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, eq));
+
+        if (!(escapes = _mm_movemask_epi8(m)))
+        {
+            _mm_storeu_si128((__m128i *) d, x);
+            d += 16;
+        }
+        else if (encode_dense(escapes, ENCODE_DENSE))
+        {
+            n = (len - i < ENCODE_DENSE_RUN ? len - i : ENCODE_DENSE_RUN);
+            d += encode_scalar(d, src + i, n);
+            i += n - 16;
+        }
+        else
+        {
+            _mm_store_si128(block, x);
+            d = encode_block(d, (unsigned char *) block, escapes, 16);
+        }
+    }
+
+    return (d - dest) + encode_scalar(d, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+long encode_avx2(unsigned char *dest, const unsigned char *src, long len)
+{
+    const __m256i ctl = _mm256_set1_epi8(31), quote = _mm256_set1_epi8('"'), pct = _mm256_set1_epi8('%'),
+                  comma = _mm256_set1_epi8(','), semi = _mm256_set1_epi8(';'), eq = _mm256_set1_epi8('=');
+    __m256i x, m, block[2] = {{0}};
+    unsigned int escapes;
+    unsigned char *d = dest;
+    long i, n;
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        x = _mm256_loadu_si256((const __m256i *) (src + i));
+
+        m = _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl), x);
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, pct)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, comma), _mm256_cmpeq_epi8(x, semi)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, eq));
+
+        if (!(escapes = (unsigned int) _mm256_movemask_epi8(m)))
+        {
+            _mm256_storeu_si256((__m256i *) d, x);
+            d += 32;
+        }
+        else if (encode_dense(escapes, 2 * ENCODE_DENSE))
+        {
+            n = (len - i < ENCODE_DENSE_RUN ? len - i : ENCODE_DENSE_RUN);
+            d += encode_scalar(d, src + i, n);
+            i += n - 32;
+        }
+        else
+        {
+            _mm256_store_si256(block, x);
+            d = encode_block(d, (unsigned char *) block, escapes, 32);
+        }
+    }
+
+    return (d - dest) + encode_sse2(d, src + i, len - i);
+}
+
+// whether more than limit bits of escapes are set, counted without popcnt, which SSE2 and AVX2 don't imply
+int encode_dense(unsigned int escapes, int limit)
+{
+    int n;
+
+    for (n = 0; escapes && n <= limit; n++)
+        escapes &= escapes - 1;
+
+    return n > limit;
+}
+
+/*
+ * Write one block of width bytes with the few bytes flagged in escapes hex encoded.
+ * The clean runs between them are copied 8 bytes at a time: block must be readable
+ * for width + 8 bytes, and the overrun is overwritten by what follows.
+ */
+unsigned char *encode_block(unsigned char *d, const unsigned char *block, unsigned int escapes, int width)
+{
+    int j = 0, k, n;
+
+    for (; escapes; escapes &= escapes - 1)
+    {
+        k = __builtin_ctz(escapes);
+
+        for (n = j; n < k; n += 8)
+            memcpy(d + n - j, block + n, 8);
+
+        d += k - j;
+        *d++ = '%';
+        *d++ = hex_digits[block[k] >> 4];
+        *d++ = hex_digits[block[k] & 15];
+        j = k + 1;
+    }
+
+    for (n = j; n < width; n += 8)
+        memcpy(d + n - j, block + n, 8);
+
+    return d + width - j;
+}
+#endif
+
+char *url_encode(const char *src, int len, int force, char *buffer)
+{
+    char *dest;
+    unsigned char tmp;
+    int j, k;
+
+    if (src == NULL)
+        return NULL;
+
+    dest = (buffer ? buffer : (char *) malloc(sizeof(char) * len * 3 + 1));
+
+    for (j = k = 0; j < len; j++)
+    {
+        tmp = (unsigned char) src[j];
+
+        if (force || url_map[tmp])
+        {
+            // force is for md5 encoding, convert to hex string without '%'
+            if (!force)
+                dest[k++] = '%';
+
+            dest[k++] = hex_digits[tmp >> 4];
+            dest[k++] = hex_digits[tmp & 15];
+        }
+        else
+            dest[k++] = tmp;
+    }
+
+    dest[k] = 0;
+    return dest;
+}
+
+void buf_init(s_buffer *b)
+{
+    memset(b, 0, sizeof(s_buffer));
+    b->spill = spill_size;
+}
+
+// a buffer that passes everything straight through to an open stream, eg stdout
+void buf_init_file(s_buffer *b, FILE *file)
+{
+    memset(b, 0, sizeof(s_buffer));
+    b->file = file;
+    b->direct = 1;
+}
+
+void buf_write(s_buffer *b, const void *data, unsigned long len)
+{
+    b->written += len;
+
+    if (b->z)
+        oddie_deflate_write(b, data, len, Z_NO_FLUSH);
+    else
+        buf_store(b, data, len);
+}
+
+// append to the buffer as is, bypassing compression
+// how many bytes can be written to *room, at the end of b's last chunk, 0 if b is compressed, on disk or about to spill
+unsigned long buf_room(s_buffer *b, unsigned char **room)
+{
+    unsigned long len;
+
+    if (b->z || b->file || !b->tail || (b->spill && b->length >= b->spill))
+        return 0;
+
+    len = BUF_CHUNK - b->tail->len;
+
+    if (b->spill && b->spill - b->length < len)
+        len = b->spill - b->length;
+
+    *room = b->tail->data + b->tail->len;
+
+    return len;
+}
+
+// the first len bytes of what buf_room() gave have been written
+void buf_wrote(s_buffer *b, unsigned long len)
+{
+    b->tail->len += len;
+    b->length += len;
+    b->written += len;
+}
+
+void buf_store(s_buffer *b, const void *data, unsigned long len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned long n;
+    s_chunk *chunk;
+
+    if (!b->file && b->spill && b->length + len > b->spill && (b->file = spill_file()))
+    {
+        // past the threshold, move what we have to disk and keep appending there
+        while ((chunk = b->head))
+        {
+            fwrite(chunk->data, 1, chunk->len, b->file);
+            b->head = chunk->next;
+            free(chunk);
+        }
+
+        b->tail = NULL;
+    }
+
+    b->length += len;
+
+    if (b->file)
+    {
+        fwrite(p, 1, len, b->file);
+        return;
+    }
+
+    while (len)
+    {
+        if (!b->tail || b->tail->len == BUF_CHUNK)
+        {
+            if ((chunk = b->spare))
+                b->spare = chunk->next;
+            else
+                chunk = (s_chunk *) malloc(sizeof(s_chunk));
+
+            chunk->next = NULL;
+            chunk->len = 0;
+
+            if (b->tail)
+                b->tail->next = chunk;
+            else
+                b->head = chunk;
+
+            b->tail = chunk;
+        }
+
+        n = BUF_CHUNK - b->tail->len;
+        if (n > len)
+            n = len;
+
+        memcpy(b->tail->data + b->tail->len, p, n);
+        b->tail->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void buf_puts(s_buffer *b, const char *str)
+{
+    buf_write(b, str, strlen(str));
+}
+
+// short formatted writes, for the response fields
+void buf_printf(s_buffer *b, const char *format, ...)
+{
+    char line[1024];
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (n > 0)
+        buf_write(b, line, (n < (int) sizeof(line) ? n : (int) sizeof(line) - 1));
+}
+
+void buf_flush(s_buffer *b)
+{
+    if (b->direct)
+        fflush(b->file);
+}
+
+// copy the whole buffer to stream
+void buf_output(s_buffer *b, FILE *stream)
+{
+    unsigned char data[16 * 1024];
+    unsigned long n;
+
+    buf_rewind(b);
+
+    while ((n = buf_read(b, data, sizeof(data))))
+        fwrite(data, 1, n, stream);
+
+    fflush(stream);
+}
+
+void buf_rewind(s_buffer *b)
+{
+    if (b->file)
+    {
+        fflush(b->file);
+        fseek(b->file, 0, SEEK_SET);
+    }
+
+    b->rchunk = b->head;
+    b->rpos = 0;
+}
+
+unsigned long buf_read(s_buffer *b, void *data, unsigned long len)
+{
+    unsigned char *p = (unsigned char *) data;
+    unsigned long n, total = 0;
+
+    if (b->file)
+        return fread(data, 1, len, b->file);
+
+    while (len && b->rchunk)
+    {
+        n = b->rchunk->len - b->rpos;
+        if (n > len)
+            n = len;
+
+        memcpy(p, b->rchunk->data + b->rpos, n);
+        p += n;
+        len -= n;
+        total += n;
+
+        if ((b->rpos += n) == b->rchunk->len)
+        {
+            b->rchunk = b->rchunk->next;
+            b->rpos = 0;
+        }
+    }
+
+    return total;
+}
+
+void buf_free(s_buffer *b)
+{
+    s_chunk *chunk;
+
+    while ((chunk = b->head))
+    {
+        b->head = chunk->next;
+        free(chunk);
+    }
+
+    while ((chunk = b->spare))
+    {
+        b->spare = chunk->next;
+        free(chunk);
+    }
+
+    if (b->file && !b->direct)
+        fclose(b->file);
+
+    if (b->z)
+        oddie_deflate_free(b);
+
+    memset(b, 0, sizeof(s_buffer));
+}
+
+// drop the content of b but keep it set up as it is, compressing or not, and up to BUF_SPARE of
+// its chunks: freed, they go back to the system and have to be faulted in again, page by page
+void buf_clear(s_buffer *b)
+{
+    s_chunk *chunk;
+    int kept = 0;
+
+    for (chunk = b->spare; chunk; chunk = chunk->next)
+        kept++;
+
+    while ((chunk = b->head))
+    {
+        b->head = chunk->next;
+
+        if (kept++ < BUF_SPARE)
+        {
+            chunk->next = b->spare;
+            b->spare = chunk;
+        }
+        else
+            free(chunk);
+    }
+
+    if (b->file && !b->direct)
+    {
+        fclose(b->file);
+        b->file = NULL;
+    }
+
+    b->tail = b->rchunk = NULL;
+    b->length = b->rpos = b->written = 0;
+}
+
+// CODEC= value, deflate for anything unknown or not built in (see HAVE_ZSTD, HAVE_LZ4)
+int codec_parse(const char *name)
+{
+#if defined(HAVE_ZSTD)
+    if (strcasecmp(name, "zstd") == 0)
+        return CODEC_ZSTD;
+#endif
+#if defined(HAVE_LZ4)
+    if (strcasecmp(name, "lz4") == 0)
+        return CODEC_LZ4;
+#endif
+    if (strcasecmp(name, "auto") == 0)
+        return CODEC_AUTO;
+
+    return CODEC_DEFLATE;
+}
+
+/*
+ * ZIP level for a result of length bytes when zip was requested, 0 for no compression.
+ * Tiny results aren't worth it, anything else gets the level asked for, up to the highest
+ * the codec has, so a result can start compressing before it has been fully fetched.
+ */
+int zip_policy(int zip, int codec, unsigned long length)
+{
+    static const int max_level[] = {9, 19, 12};
+
+    if (zip <= 0 || length < 128 || codec == CODEC_AUTO)
+        return 0;
+
+    return (zip > max_level[codec] ? max_level[codec] : zip);
+}
+
+// compress b from here on, as the request asks for a result of length bytes; request->zip is 0 if it isn't
+void zip_start(s_buffer *b, s_request *request, unsigned long length)
+{
+    if (request->codec == CODEC_AUTO && request->zip > 0 && length >= 128)
+        zip_adapt(b, request);
+    else
+        request->zip = zip_policy(request->zip, request->codec, length);
+
+    if (request->zip)
+        oddie_deflate(b, request->codec, request->zip);
+
+    if (!b->z)
+        request->zip = 0;
+}
+
+// start compressing the result as soon as the ZIP policy can't change any more,
+// with CODEC=auto once there's enough of it to sample
+void zip_probe(s_buffer *stream, s_request *request, unsigned long length)
+{
+    if (!stream->z && request->zip && length >= (request->codec == CODEC_AUTO ? ZIP_SAMPLE : ZIP_PROBE))
+        zip_start(stream, request, length);
+}
+
+/*
+ * CODEC=auto: pick request->codec and request->zip from the first ZIP_SAMPLE bytes of b, by
+ * compressing them with each candidate in turn, fastest first. The smallest output of those
+ * that keep up with --zip-target MB/s wins, the fastest one if none do, and nothing at all
+ * (request->zip 0) if the sample doesn't shrink by at least a tenth.
+ */
+void zip_adapt(s_buffer *b, s_request *request)
 {
-    char buffer[8 * 1024];
-    unsigned int pos = 0;
-    int target = 0;
-    char c, hex_hi, hex_low;
+    static const int candidates[][2] =
+    {
+#if defined(HAVE_LZ4)
+        {CODEC_LZ4, 1},
+#endif
+#if defined(HAVE_ZSTD)
+        {CODEC_ZSTD, 1}, {CODEC_ZSTD, 3}, {CODEC_ZSTD, 9},
+#else
+        // zstd beats deflate at any speed, so deflate is only tried without it
+        {CODEC_DEFLATE, 1}, {CODEC_DEFLATE, 6}, {CODEC_DEFLATE, 9},
+#endif
+    };
+    int count = sizeof(candidates) / sizeof(candidates[0]);
+    int i, best = -1, fast = -1, missed = -1;
+    unsigned long n, size, best_size = 0, fast_size = 0;
+    unsigned long out_size = ZIP_SAMPLE + ZIP_SAMPLE / 8 + 1024; // more than any codec's worst case
+    unsigned char *in = (unsigned char *) malloc(ZIP_SAMPLE);
+    unsigned char *out = (unsigned char *) malloc(out_size);
+    long long start = clock_usec(), t, usec, fast_usec = 0;
+
+    buf_rewind(b);
+    n = buf_read(b, in, ZIP_SAMPLE);
 
-    request->zip = request->id[0] = request->md5[0] = request->sql[0] = buffer[0] = 0;
+    // a spilled buffer is written to where the reading stopped
+    if (b->file)
+        fseek(b->file, 0, SEEK_END);
 
-    while (!feof(stdin))
+    for (i = 0; i < count; i++)
     {
-        c = fgetc(stdin);
+        // the higher levels of a codec that is already too slow are slower still
+        if (candidates[i][0] == missed)
+            continue;
 
-        if (c == '=')
-        {
-            buffer[pos] = 0;
+        t = clock_usec();
+        size = zip_once(candidates[i][0], candidates[i][1], in, n, out, out_size);
+        usec = clock_usec() - t;
 
-            switch (buffer[0])
-            {
-                case 'I':
-                    target = tID;
-                    break;
-                case 'M':
-                    target = tMD5;
-                    break;
-                case 'Z':
-                    target = tZIP;
-                    break;
-                case 'S':
-                    target = tSQL;
-                    break;
-                default:
-                    return 0;
-            }
+        if (!size)
+            continue;
 
-            buffer[pos = 0] = 0;
+        if (fast < 0 || usec < fast_usec)
+        {
+            fast = i;
+            fast_size = size;
+            fast_usec = usec;
         }
-        else if ((c == ',') || (c == ';'))
+
+        // bytes per microsecond are MB/s
+        if ((unsigned long long) zip_target * usec > n)
+            missed = candidates[i][0];
+        else if (best < 0 || size < best_size)
         {
-            buffer[pos] = 0;
+            best = i;
+            best_size = size;
+        }
+    }
 
-            switch (target)
-            {
-                case tID:
-                    strncpy(request->id, buffer, 64);
-                    break;
-                case tMD5:
-                    strncpy(request->md5, buffer, 33);
-                    break;
-                case tSQL:
-                    strncpy(request->sql, buffer, QUERY_BUFFER_SIZE);
-                    break;
-                case tZIP:
-                    request->zip = atoi(buffer);
-                    break;
-                default:
-                    return 0;
-            }
+    if (best < 0)
+    {
+        best = fast;
+        best_size = fast_size;
+    }
 
-            buffer[pos = 0] = 0;
+    if (best >= 0 && best_size < n - n / 10)
+    {
+        request->codec = candidates[best][0];
+        request->zip = candidates[best][1];
+    }
+    else
+        request->zip = 0;
 
-            if (c == ';')
-                return 1;
-        }
-        else if (c == '"')
-        {
-            while (!feof(stdin))
-            {
-                c = fgetc(stdin);
+    free(in);
+    free(out);
 
-                if (c == '"')
-                    break;
-                else if (c == '%')
-                {
-                    hex_hi = fgetc(stdin);
-                    hex_low = fgetc(stdin);
-                    c = (hex_digit_to_int(hex_hi) << 4) | hex_digit_to_int(hex_low);
-                }
+    if (b->ztime)
+        *b->ztime += clock_usec() - start;
+}
 
-                buffer[pos] = c;
-                    if (++pos > sizeof(buffer))
-                    return 0;
-            }
+// compress len bytes of in with codec at level into out, in one go; the compressed size, 0 on failure
+unsigned long zip_once(int codec, int level, const unsigned char *in, unsigned long len, unsigned char *out, unsigned long size)
+{
+    uLongf zlen = size;
+#if defined(HAVE_ZSTD)
+    size_t zstd_len;
+#endif
+#if defined(HAVE_LZ4)
+    LZ4F_preferences_t prefs;
+    size_t lz4_len;
+#endif
 
-            buffer[pos] = 0;
-        }
-        else if (isalnum(c))
-        {
-            buffer[pos] = c;
-            if (++pos > sizeof(buffer))
-                return 0;
-        }
+    switch (codec)
+    {
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        zstd_len = ZSTD_compress(out, size, in, len, level);
+        return (ZSTD_isError(zstd_len) ? 0 : zstd_len);
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        lz4_len = LZ4F_compressFrame(out, size, in, len, &prefs);
+        return (LZ4F_isError(lz4_len) ? 0 : lz4_len);
+#endif
+    default:
+        return (compress2(out, &zlen, in, len, level) == Z_OK ? zlen : 0);
     }
+}
 
-    return 0;
+// the ZIP field of a compressed result, and which codec when the request asked for one
+void send_zip(s_buffer *out, s_request *request)
+{
+    buf_printf(out, "ZIP=%d,", request->zip);
+
+    if (request->codec_echo)
+        buf_printf(out, "CODEC=%s,", codec_names[request->codec]);
 }
 
-long encode_out(FILE *stream, unsigned char *b, long len)
+/*
+ * def() function copied from zlib zpipe.c, split into oddie_deflate(), oddie_deflate_write()
+ * and oddie_deflate_end() so a buffer can be compressed while it is being written.
+ * oddie_deflate() compresses what is already in buffer b and switches it to compressing
+ * everything written after, until oddie_deflate_end() finishes the stream.
+ * With codec CODEC_ZSTD or CODEC_LZ4 the stream is a zstd or LZ4 frame instead of zlib.
+ * With the zip pool running, b is compressed in blocks by its threads instead (see
+ * zip_parallel_write()), still making one zlib stream, or a zstd or LZ4 frame per block.
+ * Returns Z_OK on success,
+ * Z_MEM_ERROR if memory could not be allocated for processing,
+ * Z_STREAM_ERROR if an invalid compression level is supplied,
+ * Z_VERSION_ERROR if the version of zlib.h and the version of the library linked do not match,
+ * Z_ERRNO if there is an error reading or writing a spilled buffer.
+ */
+int oddie_deflate(s_buffer *b, int codec, int level)
 {
-    char encode[4];
-    long i, n = 0;
+    int ret = Z_OK;
+    unsigned long have;
+    s_buffer source = *b;
+    void *z = NULL;
+    z_stream *strm;
+    unsigned char *in, header_zlib[2];
+#if defined(HAVE_LZ4)
+    LZ4F_preferences_t prefs;
+    LZ4F_cctx *lz4;
+    unsigned char header[LZ4F_HEADER_SIZE_MAX];
+    size_t header_len = 0;
+#endif
 
-    for (i = 0; i < len; i++)
+    if (zip_pool.count)
+        z = zip_parallel_init(codec, level);
+    else switch (codec)
     {
-        if (b[i] < 32 || b[i] == '"' || b[i] == '%' || b[i] == ';' || b[i] == ',' || b[i] == '=')
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        if (!(z = ZSTD_createCCtx()))
+            return Z_MEM_ERROR;
+
+        if (ZSTD_isError(ZSTD_CCtx_setParameter((ZSTD_CCtx *) z, ZSTD_c_compressionLevel, level)))
         {
-            sprintf(encode, "%%%02X", b[i]);
-            n+= fputs(encode, stream);
+            ZSTD_freeCCtx((ZSTD_CCtx *) z);
+            return Z_STREAM_ERROR;
         }
-        else
+        break;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        if (LZ4F_isError(LZ4F_createCompressionContext(&lz4, LZ4F_VERSION)))
+            return Z_MEM_ERROR;
+
+        // the frame header goes in before everything else
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        header_len = LZ4F_compressBegin(lz4, header, sizeof(header), &prefs);
+
+        if (LZ4F_isError(header_len))
         {
-            fputc(b[i], stream);
-            n++;
+            LZ4F_freeCompressionContext(lz4);
+            return Z_STREAM_ERROR;
         }
-    }
 
-    return n;
-}
+        z = lz4;
+        break;
+#endif
+    default:
+        codec = CODEC_DEFLATE;
+        strm = (z_stream *) malloc(sizeof(z_stream));
 
-char *url_encode(const char *src, int len, int force, char *buffer)
-{
-    char *dest, encode[3], tmp;
-    int j, k;
+        /* allocate deflate state */
+        strm->zalloc = Z_NULL;
+        strm->zfree = Z_NULL;
+        strm->opaque = Z_NULL;
+        ret = deflateInit(strm, level);
+        if (ret != Z_OK)
+        {
+            free(strm);
+            return ret;
+        }
 
-    if (src == NULL)
-        return NULL;
+        z = strm;
+    }
 
-    dest = (buffer ? buffer : (char *) malloc(sizeof(char) * len * 3 + 1));
+    /* b starts over empty, compressing, and the current content is written back through it */
+    buf_init(b);
+    b->spill = source.spill;
+    b->written = source.written;
+    b->ztime = source.ztime;
+    b->z = z;
+    b->codec = codec;
+    b->parallel = (zip_pool.count > 0);
+    b->zout = (unsigned char *) malloc(Z_CHUNK);
 
-    for (j = k = 0; j < len; j++)
+    if (b->parallel && codec == CODEC_DEFLATE)
     {
-        tmp = src[j];
+        // the zlib header deflateInit() would have written, the blocks are raw deflate
+        header_zlib[0] = 0x78;
+        header_zlib[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+        header_zlib[1] += 31 - (header_zlib[0] * 256 + header_zlib[1]) % 31;
+        buf_store(b, header_zlib, 2);
+    }
 
-        if (force ||
-            tmp == '\0' || tmp == '\t' || tmp == '\n' ||
-            tmp == '\r' || tmp == '"' || tmp == '%' ||
-            tmp == ';' || tmp == ',' || tmp == '=')
-        {
-            // force is for md5 encoding, convert to hex string without '%'
-            if (!force)
-                dest[k++] = '%';
+#if defined(HAVE_LZ4)
+    if (codec == CODEC_LZ4 && !b->parallel)
+        buf_store(b, header, header_len);
+#endif
 
-            sprintf(encode, "%02X", tmp);
-            dest[k++] = encode[0];
-            dest[k++] = encode[1];
-        }
-        else
-            dest[k++] = tmp;
-    }
+    in = (unsigned char *) malloc(Z_CHUNK);
+    buf_rewind(&source);
 
-    dest[k] = 0;
-    return dest;
+    while (ret == Z_OK && (have = buf_read(&source, in, Z_CHUNK)))
+        ret = oddie_deflate_write(b, in, have, Z_NO_FLUSH);
+
+    if (source.file && ferror(source.file))
+        ret = Z_ERRNO;
+
+    free(in);
+    buf_free(&source);
+
+    return ret;
 }
 
-/*
- * def() function copied from zlib zpipe.c renamed to oddie_deflate()
- * Compress from file source to file dest until EOF on source.
- * Returns Z_OK on success,
- * Z_MEM_ERROR if memory could not be allocated for processing,
- * Z_STREAM_ERROR if an invalid compression level is supplied,
- * Z_VERSION_ERROR if the version of zlib.h and the version of the library linked do not match,
- * Z_ERRNO if there is an error reading or writing the files.
- */
-int oddie_deflate(FILE *source, FILE *dest, int level)
+// flush is Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH, whatever the codec
+int oddie_deflate_write(s_buffer *b, const void *data, unsigned long len, int flush)
 {
-    int ret, flush;
     unsigned have;
-    z_stream strm;
-    unsigned char in[Z_CHUNK];
-    unsigned char out[Z_CHUNK];
-
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, level);
-    if (ret != Z_OK)
+    z_stream *strm = (z_stream *) b->z;
+    long long start = (b->ztime ? clock_usec() : 0);
+    int ret;
+#if defined(HAVE_ZSTD)
+    ZSTD_inBuffer zstd_in = {data, len, 0};
+    ZSTD_outBuffer zstd_out;
+    ZSTD_EndDirective mode = (flush == Z_FINISH ? ZSTD_e_end : flush == Z_SYNC_FLUSH ? ZSTD_e_flush : ZSTD_e_continue);
+    size_t left;
+#endif
+#if defined(HAVE_LZ4)
+    const unsigned char *p = (const unsigned char *) data;
+    size_t slice, lz4_len;
+#endif
+
+    if (b->parallel)
+    {
+        ret = zip_parallel_write(b, data, len, flush);
+
+        if (b->ztime)
+            *b->ztime += clock_usec() - start;
+
         return ret;
+    }
 
-    /* compress until end of file */
-    do {
-        strm.avail_in = fread(in, 1, Z_CHUNK, source);
-        if (ferror(source)) {
-            (void)deflateEnd(&strm);
-            return Z_ERRNO;
+    switch (b->codec)
+    {
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        /* until all input is taken, and when flushing until nothing is left to flush */
+        do {
+            zstd_out.dst = b->zout;
+            zstd_out.size = Z_CHUNK;
+            zstd_out.pos = 0;
+            left = ZSTD_compressStream2((ZSTD_CCtx *) b->z, &zstd_out, &zstd_in, mode);
+            if (ZSTD_isError(left))
+                return Z_STREAM_ERROR;
+            buf_store(b, b->zout, zstd_out.pos);
+            if (b->file && ferror(b->file))
+                return Z_ERRNO;
+        } while (mode == ZSTD_e_continue ? zstd_in.pos < zstd_in.size : left != 0);
+        break;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        /* in slices small enough that what comes out always fits in zout */
+        while (len)
+        {
+            slice = (len < LZ4_SLICE ? len : LZ4_SLICE);
+            lz4_len = LZ4F_compressUpdate((LZ4F_cctx *) b->z, b->zout, Z_CHUNK, p, slice, NULL);
+            if (LZ4F_isError(lz4_len))
+                return Z_STREAM_ERROR;
+            buf_store(b, b->zout, lz4_len);
+            p += slice;
+            len -= slice;
         }
-        flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
 
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
+        if (flush == Z_FINISH)
+            lz4_len = LZ4F_compressEnd((LZ4F_cctx *) b->z, b->zout, Z_CHUNK, NULL);
+        else if (flush == Z_SYNC_FLUSH)
+            lz4_len = LZ4F_flush((LZ4F_cctx *) b->z, b->zout, Z_CHUNK, NULL);
+        else
+            lz4_len = 0;
+
+        if (LZ4F_isError(lz4_len))
+            return Z_STREAM_ERROR;
+        buf_store(b, b->zout, lz4_len);
+        if (b->file && ferror(b->file))
+            return Z_ERRNO;
+        break;
+#endif
+    default:
+        strm->next_in = (Bytef *) data;
+        strm->avail_in = len;
+
+        /* run deflate() on input until output buffer not full */
         do {
-            strm.avail_out = Z_CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
+            strm->avail_out = Z_CHUNK;
+            strm->next_out = b->zout;
+            ret = deflate(strm, flush);     /* no bad return value */
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            have = Z_CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)deflateEnd(&strm);
+            have = Z_CHUNK - strm->avail_out;
+            buf_store(b, b->zout, have);
+            if (b->file && ferror(b->file))
                 return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-        assert(strm.avail_in == 0);     /* all input will be used */
+        } while (strm->avail_out == 0);
+        assert(strm->avail_in == 0);        /* all input will be used */
+    }
 
-        /* done when last data in file processed */
-    } while (flush != Z_FINISH);
-    assert(ret == Z_STREAM_END);        /* stream will be complete */
+    if (b->ztime)
+        *b->ztime += clock_usec() - start;
 
-    /* clean up and return */
-    (void) deflateEnd(&strm);
     return Z_OK;
 }
 
+int oddie_deflate_end(s_buffer *b)
+{
+    int ret = oddie_deflate_write(b, NULL, 0, Z_FINISH);
+
+    /* clean up and return, the buffer holds the complete stream */
+    oddie_deflate_free(b);
+
+    return ret;
+}
+
+// drop the compression state of b, for whichever codec
+void oddie_deflate_free(s_buffer *b)
+{
+    if (b->parallel)
+        zip_parallel_free((s_pzip *) b->z);
+    else switch (b->codec)
+    {
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        ZSTD_freeCCtx((ZSTD_CCtx *) b->z);
+        break;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        LZ4F_freeCompressionContext((LZ4F_cctx *) b->z);
+        break;
+#endif
+    default:
+        (void) deflateEnd((z_stream *) b->z);
+        free(b->z);
+    }
+
+    free(b->zout);
+    b->z = NULL;
+    b->zout = NULL;
+    b->parallel = 0;
+}
+
+#if defined(WIN32)
 void temp_file_name(char *tmpnam)
 {
     char tmppath[_MAX_PATH];
@@ -695,8 +6341,24 @@ void temp_file_name(char *tmpnam)
     GetTempPath(_MAX_PATH, tmppath);
     GetTempFileName(tmppath, "od_", 0, tmpnam);
 }
+#endif
+
+// anonymous temp file for buffer spill, removed by the system when closed
+FILE *spill_file(void)
+{
+#if defined(WIN32)
+    char filename[MAX_PATH];
+
+    temp_file_name(filename);
+
+    // D: delete on close, T: short lived, keep it in the cache if possible
+    return fopen(filename, "w+bTD");
+#else
+    return tmpfile();
+#endif
+}
 
-int error(char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h)
+int error(s_buffer *out, const char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h)
 {
     SQLSMALLINT i = 1;
     SQLCHAR     sql_state[6], msg[SQL_MAX_MESSAGE_LENGTH], buffer[24 * 1024], *enc;
@@ -707,7 +6369,9 @@ int error(char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h)
     if (IS_SQL_SUCCESS(rv))
         return 0;
 
-    printf("ERROR=\"source=%s,code=%d", src, rv);
+    stats_error(src);
+
+    buf_printf(out, "ERROR=\"source=%s,code=%d", src, rv);
 
     if (h)
     {
@@ -716,19 +6380,19 @@ int error(char *src, RETCODE rv, SQLSMALLINT htype, SQLHANDLE h)
              i++)
         {
             length = sprintf((char *) buffer, "\nSQL Error State: %s, Native Error Code: %lX, ODBC Error: %s",
-                             (LPSTR) sql_state, error_id, (LPSTR) msg);
+                             (LPSTR) sql_state, (unsigned long) error_id, (LPSTR) msg);
             enc = (SQLCHAR *) url_encode((char *) buffer, length, 0, NULL);
-            fputs((char *) enc, stdout);
+            buf_puts(out, (char *) enc);
             free(enc);
         }
     }
     else
     {
-        fputs(",NULL handle error", stdout);
+        buf_puts(out, ",NULL handle error");
     }
 
-    fputs("\";", stdout);
-    fflush(stdout);
+    buf_puts(out, "\";");
+    buf_flush(out);
 
     return rv;
 }
@@ -747,3 +6411,312 @@ void cleanup(SQLHENV henv, SQLHDBC dbh, SQLHSTMT sth)
     if (henv)
         SQLFreeHandle(SQL_HANDLE_ENV, henv);
 }
+
+// start count threads compressing blocks for buffers that oddie_deflate() sets up from now on
+int zip_pool_start(int count)
+{
+    mutex_init(&zip_pool.lock);
+    cond_init(&zip_pool.ready);
+    cond_init(&zip_pool.done);
+
+    for (zip_pool.count = 0; zip_pool.count < count; zip_pool.count++)
+        if (!thread_create(&zip_pool.threads[zip_pool.count], zip_worker, NULL))
+            return 0;
+
+    return 1;
+}
+
+void zip_pool_stop(void)
+{
+    int n;
+
+    if (!zip_pool.count)
+        return;
+
+    mutex_lock(&zip_pool.lock);
+    zip_pool.closed = 1;
+    cond_broadcast(&zip_pool.ready);
+    mutex_unlock(&zip_pool.lock);
+
+    for (n = 0; n < zip_pool.count; n++)
+        thread_join(zip_pool.threads[n]);
+
+    mutex_destroy(&zip_pool.lock);
+    cond_destroy(&zip_pool.ready);
+    cond_destroy(&zip_pool.done);
+    zip_pool.count = 0;
+}
+
+THREAD_PROC(zip_worker, arg)
+{
+    s_zip_job *job;
+
+    (void) arg;
+
+    mutex_lock(&zip_pool.lock);
+
+    for (;;)
+    {
+        while (!zip_pool.head && !zip_pool.closed)
+            cond_wait(&zip_pool.ready, &zip_pool.lock);
+
+        if (!(job = zip_pool.head))
+            break;
+
+        if (!(zip_pool.head = job->next))
+            zip_pool.tail = NULL;
+
+        mutex_unlock(&zip_pool.lock);
+        zip_job_run(job);
+        mutex_lock(&zip_pool.lock);
+
+        job->done = 1;
+        cond_broadcast(&zip_pool.done);
+    }
+
+    mutex_unlock(&zip_pool.lock);
+
+    return 0;
+}
+
+/*
+ * Compress one block, as pigz does: deflate blocks are raw deflate primed with the end of
+ * the block before and end on a byte boundary (Z_SYNC_FLUSH), so they add up to one deflate
+ * stream, only the last one finishing it; zstd and LZ4 blocks are complete frames.
+ */
+void zip_job_run(s_zip_job *job)
+{
+    unsigned char *data = job->in + job->dict_len;
+    unsigned long size;
+    z_stream strm;
+#if defined(HAVE_ZSTD)
+    size_t zstd_len;
+#endif
+#if defined(HAVE_LZ4)
+    LZ4F_preferences_t prefs;
+    size_t lz4_len;
+#endif
+
+    job->ret = Z_OK;
+
+    switch (job->codec)
+    {
+#if defined(HAVE_ZSTD)
+    case CODEC_ZSTD:
+        size = ZSTD_compressBound(job->len);
+        job->out = (unsigned char *) malloc(size);
+        zstd_len = ZSTD_compress(job->out, size, data, job->len, job->level);
+        if (ZSTD_isError(zstd_len))
+            job->ret = Z_STREAM_ERROR;
+        else
+            job->out_len = zstd_len;
+        break;
+#endif
+#if defined(HAVE_LZ4)
+    case CODEC_LZ4:
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = job->level;
+        size = LZ4F_compressFrameBound(job->len, &prefs);
+        job->out = (unsigned char *) malloc(size);
+        lz4_len = LZ4F_compressFrame(job->out, size, data, job->len, &prefs);
+        if (LZ4F_isError(lz4_len))
+            job->ret = Z_STREAM_ERROR;
+        else
+            job->out_len = lz4_len;
+        break;
+#endif
+    default:
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        job->ret = deflateInit2(&strm, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (job->ret != Z_OK)
+            break;
+
+        if (job->dict_len)
+            deflateSetDictionary(&strm, job->in, job->dict_len);
+
+        // the bound is for a finished stream, a flushed one can take a few bytes more
+        size = deflateBound(&strm, job->len) + 16;
+        job->out = (unsigned char *) malloc(size);
+        strm.next_in = data;
+        strm.avail_in = job->len;
+        strm.next_out = job->out;
+        strm.avail_out = size;
+
+        while (deflate(&strm, job->flush == Z_FINISH ? Z_FINISH : Z_SYNC_FLUSH) != Z_STREAM_ERROR && strm.avail_out == 0)
+        {
+            job->out = (unsigned char *) realloc(job->out, size * 2);
+            strm.next_out = job->out + size;
+            strm.avail_out = size;
+            size *= 2;
+        }
+
+        job->out_len = size - strm.avail_out;
+        job->adler = adler32(adler32(0L, Z_NULL, 0), data, job->len);
+        (void) deflateEnd(&strm);
+    }
+}
+
+s_pzip *zip_parallel_init(int codec, int level)
+{
+    s_pzip *pz = (s_pzip *) calloc(1, sizeof(s_pzip));
+
+    pz->codec = codec;
+    pz->level = level;
+    pz->block = (unsigned char *) malloc(ZIP_WINDOW + zip_block);
+    pz->adler = adler32(0L, Z_NULL, 0);
+
+    return pz;
+}
+
+/*
+ * oddie_deflate_write() with the zip pool: input is cut into zip_block byte blocks that are
+ * compressed by its threads, and the compressed blocks are stored in b in order as they
+ * finish. No more than two blocks per thread are held at a time, per buffer. A flush
+ * ends the current block early, and waits for all of them to be stored.
+ */
+int zip_parallel_write(s_buffer *b, const void *data, unsigned long len, int flush)
+{
+    s_pzip *pz = (s_pzip *) b->z;
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned char trailer[4];
+    unsigned long n;
+
+    while (len)
+    {
+        n = zip_block - pz->len;
+        if (n > len)
+            n = len;
+
+        memcpy(pz->block + pz->dict_len + pz->len, p, n);
+        pz->len += n;
+        p += n;
+        len -= n;
+
+        if (pz->len == zip_block)
+        {
+            zip_block_submit(pz, Z_NO_FLUSH);
+            zip_block_collect(b, 2 * zip_pool.count);
+        }
+    }
+
+    // deflate needs a last block to finish the stream, even an empty one
+    if (flush == Z_FINISH || (flush == Z_SYNC_FLUSH && pz->len))
+        zip_block_submit(pz, flush);
+
+    if (flush != Z_NO_FLUSH)
+        zip_block_collect(b, 0);
+
+    if (flush == Z_FINISH && pz->codec == CODEC_DEFLATE)
+    {
+        trailer[0] = (unsigned char) (pz->adler >> 24);
+        trailer[1] = (unsigned char) (pz->adler >> 16);
+        trailer[2] = (unsigned char) (pz->adler >> 8);
+        trailer[3] = (unsigned char) pz->adler;
+        buf_store(b, trailer, 4);
+    }
+
+    if (b->file && ferror(b->file))
+        return Z_ERRNO;
+
+    return pz->ret;
+}
+
+// hand the block being filled to the zip pool, the next one starts with its last ZIP_WINDOW bytes for deflate
+void zip_block_submit(s_pzip *pz, int flush)
+{
+    s_zip_job *job = (s_zip_job *) calloc(1, sizeof(s_zip_job));
+    unsigned long total = pz->dict_len + pz->len;
+
+    job->codec = pz->codec;
+    job->level = pz->level;
+    job->flush = flush;
+    job->in = pz->block;
+    job->dict_len = pz->dict_len;
+    job->len = pz->len;
+
+    pz->block = (unsigned char *) malloc(ZIP_WINDOW + zip_block);
+    pz->dict_len = (pz->codec == CODEC_DEFLATE ? (total < ZIP_WINDOW ? total : ZIP_WINDOW) : 0);
+    pz->len = 0;
+    memcpy(pz->block, job->in + total - pz->dict_len, pz->dict_len);
+
+    if (pz->tail)
+        pz->tail->after = job;
+    else
+        pz->head = job;
+
+    pz->tail = job;
+    pz->pending++;
+
+    mutex_lock(&zip_pool.lock);
+
+    if (zip_pool.tail)
+        zip_pool.tail->next = job;
+    else
+        zip_pool.head = job;
+
+    zip_pool.tail = job;
+    cond_signal(&zip_pool.ready);
+    mutex_unlock(&zip_pool.lock);
+}
+
+// store the finished blocks of b in order, waiting for them until no more than keep are left
+void zip_block_collect(s_buffer *b, int keep)
+{
+    s_pzip *pz = (s_pzip *) b->z;
+    s_zip_job *job;
+    int done;
+
+    while ((job = pz->head))
+    {
+        mutex_lock(&zip_pool.lock);
+
+        while (!job->done && pz->pending > keep)
+            cond_wait(&zip_pool.done, &zip_pool.lock);
+
+        done = job->done;
+        mutex_unlock(&zip_pool.lock);
+
+        if (!done)
+            break;
+
+        if (job->ret != Z_OK)
+            pz->ret = job->ret;
+
+        buf_store(b, job->out, job->out_len);
+        pz->adler = adler32_combine(pz->adler, job->adler, job->len);
+
+        if (!(pz->head = job->after))
+            pz->tail = NULL;
+
+        pz->pending--;
+        free(job->in);
+        free(job->out);
+        free(job);
+    }
+}
+
+// blocks still being compressed are waited for, their output goes nowhere
+void zip_parallel_free(s_pzip *pz)
+{
+    s_zip_job *job;
+
+    while ((job = pz->head))
+    {
+        mutex_lock(&zip_pool.lock);
+
+        while (!job->done)
+            cond_wait(&zip_pool.done, &zip_pool.lock);
+
+        mutex_unlock(&zip_pool.lock);
+
+        pz->head = job->after;
+        free(job->in);
+        free(job->out);
+        free(job);
+    }
+
+    free(pz->block);
+    free(pz);
+}
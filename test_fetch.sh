@@ -0,0 +1,63 @@
+#!/bin/sh
+# Check that block fetches return the same result as fetching one row at a time (ROWS=1),
+# against the SQLite ODBC driver, with values longer than their column's declared size.
+#
+#   ./test_fetch.sh
+#
+# Settings, from the environment, as for bench.sh:
+#   DRIVER=SQLite3          the driver's name in odbcinst.ini
+#   DB=test.db              created again on every run
+#   DRVC="Driver=$DRIVER;Database=$DB"
+#   ODDIE=./oddie           built if it doesn't exist
+
+set -e
+
+DRIVER=${DRIVER:-SQLite3}
+DB=${DB:-test.db}
+DRVC=${DRVC:-Driver=$DRIVER;Database=$DB}
+ODDIE=${ODDIE:-./oddie}
+TMP=${TMPDIR:-/tmp}/oddie-test.$$
+
+trap 'rm -f "$TMP".*' EXIT
+
+if [ ! -x "$ODDIE" ]
+then
+    gcc -Wall -Wextra -pedantic -std=gnu99 -O2 oddie.c md5.c xxhash.c -o "$ODDIE" -lodbc -lz -lpthread
+fi
+
+# SQLite keeps whatever is put in a column, the driver reports the declared size:
+# 300 characters in a varchar(5), 512 bytes in a varbinary(4), with NULLs and delimiters in between
+rm -f "$DB"
+sqlite3 "$DB" "create table t (id integer, s varchar(5), b varbinary(4), n varchar(10));
+with recursive n(i) as (select 0 union all select i + 1 from n where i < 599)
+insert into t select i,
+    case when i % 11 = 0 then null when i % 3 = 0 then printf('%.*c', 300, 'x') else 'ab' || i end
+        || case when i % 7 = 0 then char(9) || ';%' else '' end,
+    case when i % 13 = 0 then null when i % 5 = 0 then zeroblob(512) else x'0102' end,
+    'n' || i from n;"
+
+failed=0
+
+# fields appended to every request, the same result with the default block fetch and with ROWS=1
+check()
+{
+    printf 'SQL="select * from t"%s;' "$1" | "$ODDIE" "$DRVC" > "$TMP.block"
+    printf 'SQL="select * from t",ROWS=1%s;' "$1" | "$ODDIE" "$DRVC" > "$TMP.rows"
+
+    fields=${1#,}
+
+    if cmp -s "$TMP.block" "$TMP.rows"
+    then
+        echo "ok   ${fields:-default}"
+    else
+        echo "FAIL ${fields:-default}: $(wc -c < "$TMP.block") bytes, $(wc -c < "$TMP.rows") with ROWS=1"
+        failed=1
+    fi
+}
+
+check ""
+check ",HASH=XXH64"
+check ",ZIP=6"
+check ",FORMAT=columnar"
+
+exit $failed
@@ -0,0 +1,149 @@
+/*
+ * This code implements the XXH64 hash algorithm by Yann Collet
+ * (https://github.com/Cyan4973/xxHash), written from the published
+ * specification. It is a fast non-cryptographic hash, used here for
+ * change detection where MD5's strength isn't needed.
+ *
+ * Use it the same way as md5.c: declare an XXH64Context, pass it to
+ * XXH64Init, call XXH64Update as needed on buffers full of bytes, and
+ * then call XXH64Final, which will fill a supplied 8-byte array with
+ * the hash in canonical (big endian) order.
+ */
+
+#include <string.h>
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* little endian reads, whatever the machine is */
+static uint64 read64(const unsigned char *p)
+{
+    return (uint64) p[0] | (uint64) p[1] << 8 | (uint64) p[2] << 16 | (uint64) p[3] << 24 |
+           (uint64) p[4] << 32 | (uint64) p[5] << 40 | (uint64) p[6] << 48 | (uint64) p[7] << 56;
+}
+
+static uint64 read32(const unsigned char *p)
+{
+    return (uint64) p[0] | (uint64) p[1] << 8 | (uint64) p[2] << 16 | (uint64) p[3] << 24;
+}
+
+static uint64 xxh64_round(uint64 acc, uint64 input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64 xxh64_merge(uint64 acc, uint64 val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* consume one 32 byte stripe */
+static void xxh64_stripe(uint64 v[4], const unsigned char *p)
+{
+    v[0] = xxh64_round(v[0], read64(p));
+    v[1] = xxh64_round(v[1], read64(p + 8));
+    v[2] = xxh64_round(v[2], read64(p + 16));
+    v[3] = xxh64_round(v[3], read64(p + 24));
+}
+
+void XXH64Init(XXH64Context *ctx, uint64 seed)
+{
+    ctx->total = 0;
+    ctx->size = 0;
+    ctx->v[0] = seed + PRIME64_1 + PRIME64_2;
+    ctx->v[1] = seed + PRIME64_2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - PRIME64_1;
+}
+
+void XXH64Update(XXH64Context *ctx, const unsigned char *buf, unsigned len)
+{
+    const unsigned char *end = buf + len;
+    unsigned n;
+
+    ctx->total += len;
+
+    /* top up a partial stripe first */
+    if (ctx->size)
+    {
+        n = 32 - ctx->size;
+        if (len < n)
+        {
+            memcpy(ctx->in + ctx->size, buf, len);
+            ctx->size += len;
+            return;
+        }
+
+        memcpy(ctx->in + ctx->size, buf, n);
+        xxh64_stripe(ctx->v, ctx->in);
+        buf += n;
+        ctx->size = 0;
+    }
+
+    for (; end - buf >= 32; buf += 32)
+        xxh64_stripe(ctx->v, buf);
+
+    /* keep the tail for next time */
+    memcpy(ctx->in, buf, end - buf);
+    ctx->size = end - buf;
+}
+
+void XXH64Final(unsigned char digest[8], XXH64Context *ctx)
+{
+    const unsigned char *p = ctx->in, *end = ctx->in + ctx->size;
+    uint64 h;
+    int i;
+
+    if (ctx->total >= 32)
+    {
+        h = rotl64(ctx->v[0], 1) + rotl64(ctx->v[1], 7) + rotl64(ctx->v[2], 12) + rotl64(ctx->v[3], 18);
+        for (i = 0; i < 4; i++)
+            h = xxh64_merge(h, ctx->v[i]);
+    }
+    else
+    {
+        /* v[2] still holds the seed */
+        h = ctx->v[2] + PRIME64_5;
+    }
+
+    h += ctx->total;
+
+    for (; end - p >= 8; p += 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (end - p >= 4)
+    {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    for (i = 7; i >= 0; i--, h >>= 8)
+        digest[i] = (unsigned char) h;
+
+    memset(ctx, 0, sizeof(*ctx));
+}
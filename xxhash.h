@@ -0,0 +1,18 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+typedef unsigned long long uint64;
+
+typedef struct
+{
+    uint64 total;
+    uint64 v[4];
+    unsigned char in[32];
+    unsigned size;
+} XXH64Context;
+
+extern void XXH64Init(XXH64Context *ctx, uint64 seed);
+extern void XXH64Update(XXH64Context *ctx, const unsigned char *buf, unsigned len);
+extern void XXH64Final(unsigned char digest[8], XXH64Context *ctx);
+
+#endif